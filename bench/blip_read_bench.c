@@ -0,0 +1,58 @@
+// measures the cost of small reads from blip_buf with different amounts of
+// audio buffered, which should be the same no matter how much is buffered.
+// build with -DGB_APU_BENCH=ON and run blip_read_bench.
+#include "blargg/blip_buf.h"
+
+#include <stdio.h>
+#include <time.h>
+
+enum { CLOCK_RATE = 4194304 };
+enum { SAMPLE_RATE = 48000 };
+enum { READ_SIZE = 16 };
+enum { ITERATIONS = 1000000 };
+
+// keeps buffered samples available, each iteration reads READ_SIZE samples
+// and then makes READ_SIZE more available.
+static double bench_read(int buffered)
+{
+    blip_t* blip = blip_new_stereo(buffered + READ_SIZE * 2);
+    short out[READ_SIZE * 2];
+    unsigned phase = 0;
+
+    blip_set_rates(blip, CLOCK_RATE, SAMPLE_RATE);
+
+    // fill in chunks as a single frame can't be larger than blip_max_frame.
+    while (blip_samples_avail(blip) < buffered)
+    {
+        const int count = buffered - blip_samples_avail(blip);
+        const int clocks = blip_clocks_needed(blip, count < blip_max_frame ? count : blip_max_frame);
+        blip_add_delta_stereo(blip, clocks / 2, (phase ^= 1) ? 1000 : -1000, 500);
+        blip_end_frame(blip, clocks);
+    }
+
+    const clock_t start = clock();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        blip_read_samples_stereo(blip, out, READ_SIZE);
+
+        const int clocks = blip_clocks_needed(blip, READ_SIZE);
+        blip_add_delta_stereo(blip, clocks / 2, (phase ^= 1) ? 1000 : -1000, 500);
+        blip_end_frame(blip, clocks);
+    }
+    const clock_t end = clock();
+
+    blip_delete(blip);
+    return (double)(end - start) / CLOCKS_PER_SEC * 1e9 / ITERATIONS;
+}
+
+int main(void)
+{
+    static const int buffered[] = { 1024, 4096, 16384 };
+
+    for (unsigned i = 0; i < sizeof(buffered) / sizeof(buffered[0]); i++)
+    {
+        printf("%5d buffered: %7.1f ns per %d sample read\n", buffered[i], bench_read(buffered[i]), READ_SIZE);
+    }
+
+    return 0;
+}
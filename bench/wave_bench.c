@@ -0,0 +1,60 @@
+// measures the per-sample cost of the wave channel, including adding its
+// deltas to the resampler. build with -DGB_APU_BENCH=ON and run wave_bench.
+#include "gb_apu.h"
+
+#include <stdio.h>
+#include <time.h>
+
+enum { FRAME_CLOCKS = 70224 };
+enum { FRAMES = 20000 };
+
+// clocks between each wave sample is (2048 - frequency) * 2.
+static double bench_wave(unsigned frequency)
+{
+    GbApu* apu = apu_init(GbApuClockRate_DMG, 48000);
+    short out[4096];
+
+    apu_reset(apu, GbApuType_DMG);
+    apu_write_io(apu, 0xFF26, 0x80, 0);
+    apu_write_io(apu, 0xFF24, 0x77, 0);
+    apu_write_io(apu, 0xFF25, 0xFF, 0);
+
+    // a pattern where every sample differs from the last, so each one outputs a delta.
+    for (unsigned i = 0; i < 16; i++)
+    {
+        apu_write_io(apu, 0xFF30 + i, ((i * 5 + 3) & 0xF) << 4 | ((i * 11 + 8) & 0xF), 0);
+    }
+
+    apu_write_io(apu, 0xFF1A, 0x80, 0);
+    apu_write_io(apu, 0xFF1C, 0x20, 0);
+    apu_write_io(apu, 0xFF1D, frequency & 0xFF, 0);
+    apu_write_io(apu, 0xFF1E, 0x80 | (frequency >> 8), 0);
+
+    const clock_t start = clock();
+    for (int i = 0; i < FRAMES; i++)
+    {
+        apu_end_frame(apu, FRAME_CLOCKS);
+        apu_update_timestamp(apu, -FRAME_CLOCKS);
+        while (apu_read_samples(apu, out, sizeof(out) / sizeof(out[0])))
+        {
+        }
+    }
+    const clock_t end = clock();
+
+    apu_quit(apu);
+
+    const double samples = (double)FRAMES * FRAME_CLOCKS / ((2048 - frequency) * 2);
+    return (double)(end - start) / CLOCKS_PER_SEC * 1e9 / samples;
+}
+
+int main(void)
+{
+    static const unsigned frequency[] = { 1984, 2016, 2040 };
+
+    for (unsigned i = 0; i < sizeof(frequency) / sizeof(frequency[0]); i++)
+    {
+        printf("%4u clocks per sample: %5.2f ns per wave sample\n", (2048 - frequency[i]) * 2, bench_wave(frequency[i]));
+    }
+
+    return 0;
+}
@@ -100,8 +100,8 @@ public:
 	blip_resampled_time_t offset_;
 	buf_t_* buffer_;
 	long buffer_size_;
-private:
 	long reader_accum;
+private:
 	int bass_shift;
 	long sample_rate_;
 	long clock_rate_;
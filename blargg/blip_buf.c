@@ -58,18 +58,43 @@ limit the total buffered samples to blip_max_frame. That could only be
 increased by decreasing time_bits, which would reduce resample ratio accuracy.
 */
 
+typedef int buf_t;
+
+/* Adds the band-limited step for one delta into out [0] to out [half_width*2-1].
+delta2 is the portion of delta that lands on the next phase. */
+typedef void (*add_step_t)( buf_t* out, int phase, int delta, int delta2 );
+
+/* Same as add_step_t, but for a pair of deltas into interleaved left/right
+samples out [0] to out [half_width*4-1]. */
+typedef void (*add_step_stereo_t)( buf_t* out, int phase, int delta_l, int delta2_l,
+		int delta_r, int delta2_r );
+
 /** Sample buffer that resamples to output rate and accumulates samples
-until they're read out */
+until they're read out. Stereo buffers store left/right interleaved, so
+sample n of channel c is at SAMPLES( m ) [n * channels + c].
+
+Samples are kept in a ring of 'capacity' samples starting at 'head', so
+reading doesn't have to move the remaining samples down. Deltas are added
+to contiguous samples, so ones that run past the end of the ring land in
+the buf_extra samples after it, which are folded back into the start of
+the ring by blip_end_frame(). The ring is large enough that those always
+refer to the same samples as the start of the ring. */
 struct blip_t
 {
 	fixed_t factor;
 	fixed_t offset;
 	int avail;
 	int size;
-	int integrator;
+	int capacity;
+	int head;
+	int channels;
+	int integrator [2];
+	add_step_t add_step;
+	add_step_stereo_t add_step_stereo;
 };
 
-typedef int buf_t;
+static add_step_t select_add_step( void );
+static add_step_stereo_t select_add_step_stereo( void );
 
 /* probably not totally portable */
 #define SAMPLES( buf ) ((buf_t*) ((buf) + 1))
@@ -109,22 +134,36 @@ static void check_assumptions( void )
 	assert( blip_max_frame <= (fixed_t) -1 >> time_bits );
 }
 
-blip_t* blip_new( int size )
+static blip_t* blip_new_channels( int size, int channels )
 {
 	blip_t* m;
 	assert( size >= 0 );
 
-	m = (blip_t*) malloc( sizeof *m + (size + buf_extra) * sizeof (buf_t) );
+	m = (blip_t*) malloc( sizeof *m + (size + buf_extra * 3) * channels * sizeof (buf_t) );
 	if ( m )
 	{
-		m->factor = time_unit / blip_max_ratio;
-		m->size   = size;
+		m->factor   = time_unit / blip_max_ratio;
+		m->size     = size;
+		m->capacity = size + buf_extra * 2;
+		m->channels = channels;
+		m->add_step = select_add_step();
+		m->add_step_stereo = select_add_step_stereo();
 		blip_clear( m );
 		check_assumptions();
 	}
 	return m;
 }
 
+blip_t* blip_new( int size )
+{
+	return blip_new_channels( size, 1 );
+}
+
+blip_t* blip_new_stereo( int size )
+{
+	return blip_new_channels( size, 2 );
+}
+
 void blip_delete( blip_t* m )
 {
 	if ( m != NULL )
@@ -162,8 +201,10 @@ void blip_clear( blip_t* m )
 
 	m->offset     = m->factor / 2;
 	m->avail      = 0;
-	m->integrator = 0;
-	memset( SAMPLES( m ), 0, (m->size + buf_extra) * sizeof (buf_t) );
+	m->head       = 0;
+	m->integrator [0] = 0;
+	m->integrator [1] = 0;
+	memset( SAMPLES( m ), 0, (m->capacity + buf_extra) * m->channels * sizeof (buf_t) );
 }
 
 int blip_clocks_needed( const blip_t* m, int samples )
@@ -180,68 +221,459 @@ int blip_clocks_needed( const blip_t* m, int samples )
 	return (needed - m->offset + m->factor - 1) / m->factor;
 }
 
+/* Pointer to sample 'pos' samples after the oldest unread one */
+static buf_t* ring_sample( blip_t const* m, int pos )
+{
+	int i = m->head + pos;
+	if ( i >= m->capacity )
+		i -= m->capacity;
+	return SAMPLES( m ) + i * m->channels;
+}
+
 void blip_end_frame( blip_t* m, unsigned t )
 {
 	fixed_t off = t * m->factor + m->offset;
+	buf_t* buf = SAMPLES( m );
+	buf_t* tail = buf + m->capacity * m->channels;
+	int i;
+
 	m->avail += off >> time_bits;
 	m->offset = off & (time_unit - 1);
 
+	/* Fold deltas that ran past the end of the ring back to its start */
+	for ( i = 0; i < buf_extra * m->channels; i++ )
+	{
+		buf [i] += tail [i];
+		tail [i] = 0;
+	}
+
 	/* Fails if buffer size was exceeded */
 	assert( m->avail <= m->size );
 }
 
+void blip_mix( blip_t* dst, blip_t* src )
+{
+	int const count = src->avail + buf_extra;
+	int const start = dst->avail - src->avail;
+	int i, c;
+
+	assert( dst->channels == src->channels );
+	assert( dst->offset == src->offset && start >= 0 );
+
+	for ( i = 0; i < count; i++ )
+	{
+		buf_t* out = ring_sample( dst, start + i );
+		buf_t* in  = ring_sample( src, i );
+		for ( c = 0; c < src->channels; c++ )
+		{
+			out [c] += in [c];
+			in [c] = 0;
+		}
+	}
+
+	src->avail = 0;
+}
+
 int blip_samples_avail( const blip_t* m )
 {
 	return m->avail;
 }
 
-static void remove_samples( blip_t* m, int count )
+/* Number of samples that can be read from head before the ring wraps */
+static int contiguous_samples( blip_t const* m, int count )
 {
-	buf_t* buf = SAMPLES( m );
-	int remain = m->avail + buf_extra - count;
+	int const until_wrap = m->capacity - m->head;
+	return count < until_wrap ? count : until_wrap;
+}
+
+/* Clears count samples from head, which must not wrap, and advances head */
+static void remove_contiguous( blip_t* m, int count )
+{
+	memset( SAMPLES( m ) + m->head * m->channels, 0, count * m->channels * sizeof (buf_t) );
 	m->avail -= count;
+	m->head  += count;
+	if ( m->head == m->capacity )
+		m->head = 0;
+}
+
+static int read_mono( buf_t const* in, int count, short out [], int step, int sum )
+{
+	buf_t const* end = in + count;
+	do
+	{
+		/* Eliminate fraction */
+		int s = ARITH_SHIFT( sum, delta_bits );
+
+		sum += *in++;
+
+		CLAMP( s );
+
+		*out = s;
+		out += step;
+
+		/* High-pass filter */
+		sum -= s << (delta_bits - bass_shift);
+	}
+	while ( in != end );
 
-	memmove( &buf [0], &buf [count], remain * sizeof buf [0] );
-	memset( &buf [remain], 0, count * sizeof buf [0] );
+	return sum;
 }
 
 int blip_read_samples( blip_t* m, short out [], int count, int stereo )
 {
+	int const step = stereo ? 2 : 1;
+	int remain;
+
 	assert( count >= 0 );
+	assert( m->channels == 1 );
 
 	if ( count > m->avail )
 		count = m->avail;
 
-	if ( count )
+	/* At most two passes, one either side of the end of the ring */
+	for ( remain = count; remain; )
 	{
-		int const step = stereo ? 2 : 1;
-		buf_t const* in  = SAMPLES( m );
-		buf_t const* end = in + count;
-		int sum = m->integrator;
-		do
-		{
-			/* Eliminate fraction */
-			int s = ARITH_SHIFT( sum, delta_bits );
+		int const n = contiguous_samples( m, remain );
+		m->integrator [0] = read_mono( ring_sample( m, 0 ), n, out, step, m->integrator [0] );
+		remove_contiguous( m, n );
+		out += n * step;
+		remain -= n;
+	}
 
-			sum += *in++;
+	return count;
+}
 
-			CLAMP( s );
+static void read_stereo( buf_t const* in, int count, short out [], int sums [2] )
+{
+	buf_t const* end = in + count * 2;
+	int sum_l = sums [0];
+	int sum_r = sums [1];
+	do
+	{
+		/* Eliminate fraction */
+		int l = ARITH_SHIFT( sum_l, delta_bits );
+		int r = ARITH_SHIFT( sum_r, delta_bits );
 
-			*out = s;
-			out += step;
+		sum_l += in [0];
+		sum_r += in [1];
+		in += 2;
 
-			/* High-pass filter */
-			sum -= s << (delta_bits - bass_shift);
-		}
-		while ( in != end );
-		m->integrator = sum;
+		CLAMP( l );
+		CLAMP( r );
+
+		out [0] = l;
+		out [1] = r;
+		out += 2;
+
+		/* High-pass filter */
+		sum_l -= l << (delta_bits - bass_shift);
+		sum_r -= r << (delta_bits - bass_shift);
+	}
+	while ( in != end );
 
-		remove_samples( m, count );
+	sums [0] = sum_l;
+	sums [1] = sum_r;
+}
+
+int blip_read_samples_stereo( blip_t* m, short out [], int count )
+{
+	int remain;
+
+	assert( count >= 0 );
+	assert( m->channels == 2 );
+
+	if ( count > m->avail )
+		count = m->avail;
+
+	for ( remain = count; remain; )
+	{
+		int const n = contiguous_samples( m, remain );
+		read_stereo( ring_sample( m, 0 ), n, out, m->integrator );
+		remove_contiguous( m, n );
+		out += n * 2;
+		remain -= n;
 	}
 
 	return count;
 }
 
+/* Same as read_mono(), but writes unclamped samples. The high-pass filter
+still uses the clamped ones, so the integrator matches whichever is read. */
+static int read_mono_s32( buf_t const* in, int count, int out [], int step, int sum )
+{
+	buf_t const* end = in + count;
+	do
+	{
+		/* Eliminate fraction */
+		int s = ARITH_SHIFT( sum, delta_bits );
+
+		sum += *in++;
+
+		*out = s;
+		out += step;
+
+		CLAMP( s );
+
+		/* High-pass filter */
+		sum -= s << (delta_bits - bass_shift);
+	}
+	while ( in != end );
+
+	return sum;
+}
+
+static int read_mono_f32( buf_t const* in, int count, float out [], int step, int sum )
+{
+	float const scale = 1.0f / (max_sample + 1);
+	buf_t const* end = in + count;
+	do
+	{
+		/* Eliminate fraction */
+		int s = ARITH_SHIFT( sum, delta_bits );
+
+		sum += *in++;
+
+		*out = s * scale;
+		out += step;
+
+		CLAMP( s );
+
+		/* High-pass filter */
+		sum -= s << (delta_bits - bass_shift);
+	}
+	while ( in != end );
+
+	return sum;
+}
+
+int blip_read_samples_s32( blip_t* m, int out [], int count, int stereo )
+{
+	int const step = stereo ? 2 : 1;
+	int remain;
+
+	assert( count >= 0 );
+	assert( m->channels == 1 );
+
+	if ( count > m->avail )
+		count = m->avail;
+
+	for ( remain = count; remain; )
+	{
+		int const n = contiguous_samples( m, remain );
+		m->integrator [0] = read_mono_s32( ring_sample( m, 0 ), n, out, step, m->integrator [0] );
+		remove_contiguous( m, n );
+		out += n * step;
+		remain -= n;
+	}
+
+	return count;
+}
+
+int blip_read_samples_f32( blip_t* m, float out [], int count, int stereo )
+{
+	int const step = stereo ? 2 : 1;
+	int remain;
+
+	assert( count >= 0 );
+	assert( m->channels == 1 );
+
+	if ( count > m->avail )
+		count = m->avail;
+
+	for ( remain = count; remain; )
+	{
+		int const n = contiguous_samples( m, remain );
+		m->integrator [0] = read_mono_f32( ring_sample( m, 0 ), n, out, step, m->integrator [0] );
+		remove_contiguous( m, n );
+		out += n * step;
+		remain -= n;
+	}
+
+	return count;
+}
+
+/* Same as read_stereo(), but writes unclamped samples. The high-pass filter
+still uses the clamped ones, so the integrators match whichever is read. */
+static void read_stereo_s32( buf_t const* in, int count, int out_l [], int out_r [],
+		int step, int sums [2] )
+{
+	buf_t const* end = in + count * 2;
+	int sum_l = sums [0];
+	int sum_r = sums [1];
+	do
+	{
+		/* Eliminate fraction */
+		int l = ARITH_SHIFT( sum_l, delta_bits );
+		int r = ARITH_SHIFT( sum_r, delta_bits );
+
+		sum_l += in [0];
+		sum_r += in [1];
+		in += 2;
+
+		*out_l = l;
+		*out_r = r;
+		out_l += step;
+		out_r += step;
+
+		CLAMP( l );
+		CLAMP( r );
+
+		/* High-pass filter */
+		sum_l -= l << (delta_bits - bass_shift);
+		sum_r -= r << (delta_bits - bass_shift);
+	}
+	while ( in != end );
+
+	sums [0] = sum_l;
+	sums [1] = sum_r;
+}
+
+static void read_stereo_f32( buf_t const* in, int count, float out_l [], float out_r [],
+		int step, int sums [2] )
+{
+	float const scale = 1.0f / (max_sample + 1);
+	buf_t const* end = in + count * 2;
+	int sum_l = sums [0];
+	int sum_r = sums [1];
+	do
+	{
+		/* Eliminate fraction */
+		int l = ARITH_SHIFT( sum_l, delta_bits );
+		int r = ARITH_SHIFT( sum_r, delta_bits );
+
+		sum_l += in [0];
+		sum_r += in [1];
+		in += 2;
+
+		*out_l = l * scale;
+		*out_r = r * scale;
+		out_l += step;
+		out_r += step;
+
+		CLAMP( l );
+		CLAMP( r );
+
+		/* High-pass filter */
+		sum_l -= l << (delta_bits - bass_shift);
+		sum_r -= r << (delta_bits - bass_shift);
+	}
+	while ( in != end );
+
+	sums [0] = sum_l;
+	sums [1] = sum_r;
+}
+
+int blip_read_samples_stereo_s32( blip_t* m, int out_l [], int out_r [], int step, int count )
+{
+	int remain;
+
+	assert( count >= 0 );
+	assert( m->channels == 2 );
+
+	if ( count > m->avail )
+		count = m->avail;
+
+	for ( remain = count; remain; )
+	{
+		int const n = contiguous_samples( m, remain );
+		read_stereo_s32( ring_sample( m, 0 ), n, out_l, out_r, step, m->integrator );
+		remove_contiguous( m, n );
+		out_l += n * step;
+		out_r += n * step;
+		remain -= n;
+	}
+
+	return count;
+}
+
+int blip_read_samples_stereo_f32( blip_t* m, float out_l [], float out_r [], int step, int count )
+{
+	int remain;
+
+	assert( count >= 0 );
+	assert( m->channels == 2 );
+
+	if ( count > m->avail )
+		count = m->avail;
+
+	for ( remain = count; remain; )
+	{
+		int const n = contiguous_samples( m, remain );
+		read_stereo_f32( ring_sample( m, 0 ), n, out_l, out_r, step, m->integrator );
+		remove_contiguous( m, n );
+		out_l += n * step;
+		out_r += n * step;
+		remain -= n;
+	}
+
+	return count;
+}
+
+/* Value of sample 'pos' after the oldest unread one, including any part of it
+that's still past the end of the ring */
+static int ring_value( blip_t const* m, int pos, int channel )
+{
+	buf_t const* buf = SAMPLES( m );
+	int i = m->head + pos;
+	int value;
+	if ( i >= m->capacity )
+		i -= m->capacity;
+
+	value = buf [i * m->channels + channel];
+	if ( i < buf_extra )
+		value += buf [(m->capacity + i) * m->channels + channel];
+	return value;
+}
+
+/* Integrator after reading count samples of channel, without removing them */
+static int integrate( blip_t const* m, int count, int channel )
+{
+	int sum = m->integrator [channel];
+	int i;
+	for ( i = 0; i < count; i++ )
+	{
+		int s = ARITH_SHIFT( sum, delta_bits );
+		CLAMP( s );
+		sum += ring_value( m, i, channel );
+		sum -= s << (delta_bits - bass_shift);
+	}
+	return sum;
+}
+
+void blip_save_tail( const blip_t* m, blip_tail_t* out )
+{
+	int i, c;
+
+	assert( m->channels <= 2 );
+	assert( (int) blip_tail_samples == (int) buf_extra );
+
+	memset( out, 0, sizeof *out );
+	out->offset = m->offset;
+	for ( c = 0; c < m->channels; c++ )
+	{
+		out->integrator [c] = integrate( m, m->avail, c );
+		for ( i = 0; i < blip_tail_samples; i++ )
+			out->samples [i * 2 + c] = ring_value( m, m->avail + i, c );
+	}
+}
+
+void blip_load_tail( blip_t* m, const blip_tail_t* in )
+{
+	buf_t* out = SAMPLES( m );
+	int i, c;
+
+	assert( m->channels <= 2 );
+
+	blip_clear( m );
+	m->offset = (fixed_t) in->offset;
+	for ( c = 0; c < m->channels; c++ )
+	{
+		m->integrator [c] = in->integrator [c];
+		for ( i = 0; i < blip_tail_samples; i++ )
+			out [i * m->channels + c] = in->samples [i * 2 + c];
+	}
+}
+
 /* Things that didn't help performance on x86:
 	__attribute__((aligned(128)))
 	#define short int
@@ -286,28 +718,31 @@ static short const bl_step [phase_count + 1] [half_width] =
 {    0,   43, -115,  350, -488, 1136, -914, 5861}
 };
 
-/* Shifting by pre_shift allows calculation using unsigned int rather than
-possibly-wider fixed_t. On 32-bit platforms, this is likely more efficient.
-And by having pre_shift 32, a 32-bit platform can easily do the shift by
-simply ignoring the low half. */
+/* SIMD versions of the step kernel. Each one produces exactly the same
+result as add_step_c. The SSE2/AVX2 kernels use 16x16->32-bit multiply-adds,
+which need delta and delta2 to fit in 16 bits, and fall back to add_step_c
+otherwise. Define BLIP_NO_SIMD to disable them. */
+#if !defined (BLIP_NO_SIMD) && (defined (__x86_64__) || defined (__i386__) || \
+	defined (_M_X64) || defined (_M_IX86))
+	#define BLIP_SIMD_X86 1
+	#include <immintrin.h>
+	#if defined (_MSC_VER) && !defined (__clang__)
+		#include <intrin.h>
+		#define BLIP_TARGET( t )
+	#else
+		#define BLIP_TARGET( t ) __attribute__((target( t )))
+	#endif
+#elif !defined (BLIP_NO_SIMD) && (defined (__ARM_NEON) || defined (__ARM_NEON__) || \
+	defined (__aarch64__) || defined (_M_ARM64))
+	#define BLIP_SIMD_NEON 1
+	#include <arm_neon.h>
+#endif
 
-void blip_add_delta( blip_t* m, unsigned time, int delta )
+static void add_step_c( buf_t* out, int phase, int delta, int delta2 )
 {
-	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
-	buf_t* out = SAMPLES( m ) + m->avail + (fixed >> frac_bits);
-
-	int const phase_shift = frac_bits - phase_bits;
-	int phase = fixed >> phase_shift & (phase_count - 1);
 	short const* in  = bl_step [phase];
 	short const* rev = bl_step [phase_count - phase];
 
-	int interp = fixed >> (phase_shift - delta_bits) & (delta_unit - 1);
-	int delta2 = (delta * interp) >> delta_bits;
-	delta -= delta2;
-
-	/* Fails if buffer size was exceeded */
-	assert( out <= &SAMPLES( m ) [m->size + end_frame_extra] );
-
 	out [0] += in[0]*delta + in[half_width+0]*delta2;
 	out [1] += in[1]*delta + in[half_width+1]*delta2;
 	out [2] += in[2]*delta + in[half_width+2]*delta2;
@@ -328,17 +763,445 @@ void blip_add_delta( blip_t* m, unsigned time, int delta )
 	out [15] += in[0]*delta + in[0-half_width]*delta2;
 }
 
+static void add_step_stereo_c( buf_t* out, int phase, int delta_l, int delta2_l,
+		int delta_r, int delta2_r )
+{
+	short const* in  = bl_step [phase];
+	short const* rev = bl_step [phase_count - phase];
+	int i;
+
+	for ( i = 0; i < half_width; i++ )
+	{
+		out [i*2+0] += in[i]*delta_l + in[half_width+i]*delta2_l;
+		out [i*2+1] += in[i]*delta_r + in[half_width+i]*delta2_r;
+	}
+
+	out += half_width * 2;
+	for ( i = 0; i < half_width; i++ )
+	{
+		out [i*2+0] += rev[half_width-1-i]*delta_l + rev[-1-i]*delta2_l;
+		out [i*2+1] += rev[half_width-1-i]*delta_r + rev[-1-i]*delta2_r;
+	}
+}
+
+#if defined (BLIP_SIMD_X86) && BLIP_SIMD_X86
+
+/* Reverses the order of the 8 shorts in x */
+#define REVERSE_EPI16( x ) \
+	_mm_shufflehi_epi16( _mm_shufflelo_epi16( _mm_shuffle_epi32( (x), 0x4E ), 0x1B ), 0x1B )
+
+#define ADD_EPI32( out, v ) \
+	_mm_storeu_si128( (__m128i*) (out), _mm_add_epi32( _mm_loadu_si128( (__m128i const*) (out) ), (v) ) )
+
+BLIP_TARGET( "sse2" )
+static void add_step_sse2( buf_t* out, int phase, int delta, int delta2 )
+{
+	__m128i d, a, b;
+
+	if ( (short) delta != delta || (short) delta2 != delta2 )
+	{
+		add_step_c( out, phase, delta, delta2 );
+		return;
+	}
+
+	/* each 32-bit lane holds the pair (delta, delta2) */
+	d = _mm_set1_epi32( (delta & 0xFFFF) | (int) ((unsigned) delta2 << 16) );
+
+	/* out [0-7]: bl_step [phase] [i] and bl_step [phase + 1] [i] */
+	a = _mm_loadu_si128( (__m128i const*) bl_step [phase] );
+	b = _mm_loadu_si128( (__m128i const*) bl_step [phase + 1] );
+	ADD_EPI32( out + 0, _mm_madd_epi16( _mm_unpacklo_epi16( a, b ), d ) );
+	ADD_EPI32( out + 4, _mm_madd_epi16( _mm_unpackhi_epi16( a, b ), d ) );
+
+	/* out [8-15]: same again from the reversed phase, read backwards */
+	a = REVERSE_EPI16( _mm_loadu_si128( (__m128i const*) bl_step [phase_count - phase] ) );
+	b = REVERSE_EPI16( _mm_loadu_si128( (__m128i const*) bl_step [phase_count - phase - 1] ) );
+	ADD_EPI32( out +  8, _mm_madd_epi16( _mm_unpacklo_epi16( a, b ), d ) );
+	ADD_EPI32( out + 12, _mm_madd_epi16( _mm_unpackhi_epi16( a, b ), d ) );
+}
+
+/* Each (row, next row) pair is duplicated so it's multiplied by both the
+left and right delta pairs, giving interleaved output. */
+#define ADD_STEREO_EPI32( out, p, d ) \
+	ADD_EPI32( (out) + 0, _mm_madd_epi16( _mm_unpacklo_epi32( (p), (p) ), (d) ) ); \
+	ADD_EPI32( (out) + 4, _mm_madd_epi16( _mm_unpackhi_epi32( (p), (p) ), (d) ) )
+
+BLIP_TARGET( "sse2" )
+static void add_step_stereo_sse2( buf_t* out, int phase, int delta_l, int delta2_l,
+		int delta_r, int delta2_r )
+{
+	__m128i d, a, b;
+
+	if ( (short) delta_l != delta_l || (short) delta2_l != delta2_l ||
+			(short) delta_r != delta_r || (short) delta2_r != delta2_r )
+	{
+		add_step_stereo_c( out, phase, delta_l, delta2_l, delta_r, delta2_r );
+		return;
+	}
+
+	d = _mm_setr_epi32( (delta_l & 0xFFFF) | (int) ((unsigned) delta2_l << 16),
+			(delta_r & 0xFFFF) | (int) ((unsigned) delta2_r << 16),
+			(delta_l & 0xFFFF) | (int) ((unsigned) delta2_l << 16),
+			(delta_r & 0xFFFF) | (int) ((unsigned) delta2_r << 16) );
+
+	a = _mm_loadu_si128( (__m128i const*) bl_step [phase] );
+	b = _mm_loadu_si128( (__m128i const*) bl_step [phase + 1] );
+	ADD_STEREO_EPI32( out +  0, _mm_unpacklo_epi16( a, b ), d );
+	ADD_STEREO_EPI32( out +  8, _mm_unpackhi_epi16( a, b ), d );
+
+	a = REVERSE_EPI16( _mm_loadu_si128( (__m128i const*) bl_step [phase_count - phase] ) );
+	b = REVERSE_EPI16( _mm_loadu_si128( (__m128i const*) bl_step [phase_count - phase - 1] ) );
+	ADD_STEREO_EPI32( out + 16, _mm_unpacklo_epi16( a, b ), d );
+	ADD_STEREO_EPI32( out + 24, _mm_unpackhi_epi16( a, b ), d );
+}
+
+#undef ADD_STEREO_EPI32
+
+BLIP_TARGET( "avx2" )
+static void add_step_avx2( buf_t* out, int phase, int delta, int delta2 )
+{
+	/* Rows phase and phase + 1 are contiguous, so one 256-bit load covers both.
+	The qwords are permuted so each 128-bit lane holds 4 shorts of each row,
+	then the shuffle interleaves them into (row, next row) pairs. */
+	__m256i const fwd_order = _mm256_setr_epi8(
+		0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+		0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15 );
+	__m256i const rev_order = _mm256_setr_epi8(
+		14, 15, 6, 7, 12, 13, 4, 5, 10, 11, 2, 3, 8, 9, 0, 1,
+		14, 15, 6, 7, 12, 13, 4, 5, 10, 11, 2, 3, 8, 9, 0, 1 );
+	__m256i d, v, o;
+
+	if ( (short) delta != delta || (short) delta2 != delta2 )
+	{
+		add_step_c( out, phase, delta, delta2 );
+		return;
+	}
+
+	d = _mm256_set1_epi32( (delta & 0xFFFF) | (int) ((unsigned) delta2 << 16) );
+
+	v = _mm256_loadu_si256( (__m256i const*) bl_step [phase] );
+	v = _mm256_shuffle_epi8( _mm256_permute4x64_epi64( v, 0xD8 ), fwd_order );
+	o = _mm256_loadu_si256( (__m256i const*) (out + 0) );
+	_mm256_storeu_si256( (__m256i*) (out + 0), _mm256_add_epi32( o, _mm256_madd_epi16( v, d ) ) );
+
+	v = _mm256_loadu_si256( (__m256i const*) bl_step [phase_count - phase - 1] );
+	v = _mm256_shuffle_epi8( _mm256_permute4x64_epi64( v, 0x8D ), rev_order );
+	o = _mm256_loadu_si256( (__m256i const*) (out + 8) );
+	_mm256_storeu_si256( (__m256i*) (out + 8), _mm256_add_epi32( o, _mm256_madd_epi16( v, d ) ) );
+}
+
+#define ADD_EPI32_256( out, v ) \
+	_mm256_storeu_si256( (__m256i*) (out), _mm256_add_epi32( \
+		_mm256_loadu_si256( (__m256i const*) (out) ), (v) ) )
+
+BLIP_TARGET( "avx2" )
+static void add_step_stereo_avx2( buf_t* out, int phase, int delta_l, int delta2_l,
+		int delta_r, int delta2_r )
+{
+	/* Pairs are built as in add_step_avx2, then each is duplicated so it's
+	multiplied by both the left and right delta pairs. */
+	__m256i const fwd_order = _mm256_setr_epi8(
+		0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+		0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15 );
+	__m256i const rev_order = _mm256_setr_epi8(
+		14, 15, 6, 7, 12, 13, 4, 5, 10, 11, 2, 3, 8, 9, 0, 1,
+		14, 15, 6, 7, 12, 13, 4, 5, 10, 11, 2, 3, 8, 9, 0, 1 );
+	__m256i const lo_pairs = _mm256_setr_epi32( 0, 0, 1, 1, 2, 2, 3, 3 );
+	__m256i const hi_pairs = _mm256_setr_epi32( 4, 4, 5, 5, 6, 6, 7, 7 );
+	__m256i d, v;
+
+	if ( (short) delta_l != delta_l || (short) delta2_l != delta2_l ||
+			(short) delta_r != delta_r || (short) delta2_r != delta2_r )
+	{
+		add_step_stereo_c( out, phase, delta_l, delta2_l, delta_r, delta2_r );
+		return;
+	}
+
+	d = _mm256_broadcastsi128_si256( _mm_setr_epi32(
+		(delta_l & 0xFFFF) | (int) ((unsigned) delta2_l << 16),
+		(delta_r & 0xFFFF) | (int) ((unsigned) delta2_r << 16),
+		(delta_l & 0xFFFF) | (int) ((unsigned) delta2_l << 16),
+		(delta_r & 0xFFFF) | (int) ((unsigned) delta2_r << 16) ) );
+
+	v = _mm256_loadu_si256( (__m256i const*) bl_step [phase] );
+	v = _mm256_shuffle_epi8( _mm256_permute4x64_epi64( v, 0xD8 ), fwd_order );
+	ADD_EPI32_256( out +  0, _mm256_madd_epi16( _mm256_permutevar8x32_epi32( v, lo_pairs ), d ) );
+	ADD_EPI32_256( out +  8, _mm256_madd_epi16( _mm256_permutevar8x32_epi32( v, hi_pairs ), d ) );
+
+	v = _mm256_loadu_si256( (__m256i const*) bl_step [phase_count - phase - 1] );
+	v = _mm256_shuffle_epi8( _mm256_permute4x64_epi64( v, 0x8D ), rev_order );
+	ADD_EPI32_256( out + 16, _mm256_madd_epi16( _mm256_permutevar8x32_epi32( v, lo_pairs ), d ) );
+	ADD_EPI32_256( out + 24, _mm256_madd_epi16( _mm256_permutevar8x32_epi32( v, hi_pairs ), d ) );
+}
+
+#undef ADD_EPI32_256
+
+#undef REVERSE_EPI16
+#undef ADD_EPI32
+
+static int cpu_has_avx2( void )
+{
+#if defined (_MSC_VER) && !defined (__clang__)
+	int regs [4];
+	__cpuid( regs, 0 );
+	if ( regs [0] < 7 )
+		return 0;
+
+	/* OSXSAVE and AVX, then check the OS saves the ymm registers */
+	__cpuid( regs, 1 );
+	if ( (regs [2] & 0x18000000) != 0x18000000 || (_xgetbv( 0 ) & 6) != 6 )
+		return 0;
+
+	__cpuidex( regs, 7, 0 );
+	return (regs [1] >> 5) & 1;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "avx2" );
+#endif
+}
+
+static int cpu_has_sse2( void )
+{
+#if defined (__x86_64__) || defined (_M_X64)
+	return 1;
+#elif defined (_MSC_VER) && !defined (__clang__)
+	int regs [4];
+	__cpuid( regs, 1 );
+	return (regs [3] >> 26) & 1;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "sse2" );
+#endif
+}
+
+#elif defined (BLIP_SIMD_NEON) && BLIP_SIMD_NEON
+
+/* Widens to 32 bits before multiplying, so any delta is handled exactly */
+#define STEP_S32( out, a, b ) \
+	vst1q_s32( (out), vmlaq_n_s32( vmlaq_n_s32( vld1q_s32( out ), (a), delta ), (b), delta2 ) )
+
+static int16x8_t reverse_s16( int16x8_t x )
+{
+	x = vrev64q_s16( x );
+	return vcombine_s16( vget_high_s16( x ), vget_low_s16( x ) );
+}
+
+static void add_step_neon( buf_t* out, int phase, int delta, int delta2 )
+{
+	int16x8_t a = vld1q_s16( bl_step [phase] );
+	int16x8_t b = vld1q_s16( bl_step [phase + 1] );
+	STEP_S32( out + 0, vmovl_s16( vget_low_s16 ( a ) ), vmovl_s16( vget_low_s16 ( b ) ) );
+	STEP_S32( out + 4, vmovl_s16( vget_high_s16( a ) ), vmovl_s16( vget_high_s16( b ) ) );
+
+	a = reverse_s16( vld1q_s16( bl_step [phase_count - phase] ) );
+	b = reverse_s16( vld1q_s16( bl_step [phase_count - phase - 1] ) );
+	STEP_S32( out +  8, vmovl_s16( vget_low_s16 ( a ) ), vmovl_s16( vget_low_s16 ( b ) ) );
+	STEP_S32( out + 12, vmovl_s16( vget_high_s16( a ) ), vmovl_s16( vget_high_s16( b ) ) );
+}
+
+#undef STEP_S32
+
+/* Computes 4 left and 4 right taps, then zips them into interleaved output */
+static void step_stereo_neon( buf_t* out, int16x4_t a16, int16x4_t b16, int delta_l,
+		int delta2_l, int delta_r, int delta2_r )
+{
+	int32x4_t const a = vmovl_s16( a16 );
+	int32x4_t const b = vmovl_s16( b16 );
+	int32x4_t const l = vmlaq_n_s32( vmulq_n_s32( a, delta_l ), b, delta2_l );
+	int32x4_t const r = vmlaq_n_s32( vmulq_n_s32( a, delta_r ), b, delta2_r );
+	int32x4x2_t const lr = vzipq_s32( l, r );
+	vst1q_s32( out + 0, vaddq_s32( vld1q_s32( out + 0 ), lr.val [0] ) );
+	vst1q_s32( out + 4, vaddq_s32( vld1q_s32( out + 4 ), lr.val [1] ) );
+}
+
+static void add_step_stereo_neon( buf_t* out, int phase, int delta_l, int delta2_l,
+		int delta_r, int delta2_r )
+{
+	int16x8_t a = vld1q_s16( bl_step [phase] );
+	int16x8_t b = vld1q_s16( bl_step [phase + 1] );
+	step_stereo_neon( out +  0, vget_low_s16 ( a ), vget_low_s16 ( b ), delta_l, delta2_l, delta_r, delta2_r );
+	step_stereo_neon( out +  8, vget_high_s16( a ), vget_high_s16( b ), delta_l, delta2_l, delta_r, delta2_r );
+
+	a = reverse_s16( vld1q_s16( bl_step [phase_count - phase] ) );
+	b = reverse_s16( vld1q_s16( bl_step [phase_count - phase - 1] ) );
+	step_stereo_neon( out + 16, vget_low_s16 ( a ), vget_low_s16 ( b ), delta_l, delta2_l, delta_r, delta2_r );
+	step_stereo_neon( out + 24, vget_high_s16( a ), vget_high_s16( b ), delta_l, delta2_l, delta_r, delta2_r );
+}
+
+#endif
+
+/* Picks the fastest kernel the cpu supports */
+static add_step_t select_add_step( void )
+{
+#if defined (BLIP_SIMD_X86) && BLIP_SIMD_X86
+	if ( cpu_has_avx2() )
+		return add_step_avx2;
+	if ( cpu_has_sse2() )
+		return add_step_sse2;
+#elif defined (BLIP_SIMD_NEON) && BLIP_SIMD_NEON
+	return add_step_neon;
+#endif
+	return add_step_c;
+}
+
+static add_step_stereo_t select_add_step_stereo( void )
+{
+#if defined (BLIP_SIMD_X86) && BLIP_SIMD_X86
+	if ( cpu_has_avx2() )
+		return add_step_stereo_avx2;
+	if ( cpu_has_sse2() )
+		return add_step_stereo_sse2;
+#elif defined (BLIP_SIMD_NEON) && BLIP_SIMD_NEON
+	return add_step_stereo_neon;
+#endif
+	return add_step_stereo_c;
+}
+
+/* Shifting by pre_shift allows calculation using unsigned int rather than
+possibly-wider fixed_t. On 32-bit platforms, this is likely more efficient.
+And by having pre_shift 32, a 32-bit platform can easily do the shift by
+simply ignoring the low half. */
+
+void blip_add_delta( blip_t* m, unsigned time, int delta )
+{
+	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
+	int const pos = m->avail + (fixed >> frac_bits);
+	buf_t* out = ring_sample( m, pos );
+
+	int const phase_shift = frac_bits - phase_bits;
+	int phase = fixed >> phase_shift & (phase_count - 1);
+
+	int interp = fixed >> (phase_shift - delta_bits) & (delta_unit - 1);
+	int delta2 = (delta * interp) >> delta_bits;
+	delta -= delta2;
+
+	/* Fails if buffer size was exceeded */
+	assert( pos <= m->size + end_frame_extra );
+	assert( m->channels == 1 );
+
+	m->add_step( out, phase, delta, delta2 );
+}
+
+void blip_add_delta_stereo( blip_t* m, unsigned time, int delta_l, int delta_r )
+{
+	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
+	int const pos = m->avail + (fixed >> frac_bits);
+	buf_t* out = ring_sample( m, pos );
+
+	int const phase_shift = frac_bits - phase_bits;
+	int phase = fixed >> phase_shift & (phase_count - 1);
+
+	int interp = fixed >> (phase_shift - delta_bits) & (delta_unit - 1);
+	int delta2_l = (delta_l * interp) >> delta_bits;
+	int delta2_r = (delta_r * interp) >> delta_bits;
+	delta_l -= delta2_l;
+	delta_r -= delta2_r;
+
+	/* Fails if buffer size was exceeded */
+	assert( pos <= m->size + end_frame_extra );
+	assert( m->channels == 2 );
+
+	m->add_step_stereo( out, phase, delta_l, delta2_l, delta_r, delta2_r );
+}
+
 void blip_add_delta_fast( blip_t* m, unsigned time, int delta )
 {
 	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
-	buf_t* out = SAMPLES( m ) + m->avail + (fixed >> frac_bits);
+	int const pos = m->avail + (fixed >> frac_bits);
+	buf_t* out = ring_sample( m, pos );
 
 	int interp = fixed >> (frac_bits - delta_bits) & (delta_unit - 1);
 	int delta2 = delta * interp;
 
 	/* Fails if buffer size was exceeded */
-	assert( out <= &SAMPLES( m ) [m->size + end_frame_extra] );
+	assert( pos <= m->size + end_frame_extra );
+	assert( m->channels == 1 );
 
 	out [7] += delta * delta_unit - delta2;
 	out [8] += delta2;
 }
+
+void blip_add_delta_stereo_fast( blip_t* m, unsigned time, int delta_l, int delta_r )
+{
+	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
+	int const pos = m->avail + (fixed >> frac_bits);
+	buf_t* out = ring_sample( m, pos );
+
+	int interp = fixed >> (frac_bits - delta_bits) & (delta_unit - 1);
+	int delta2_l = delta_l * interp;
+	int delta2_r = delta_r * interp;
+
+	/* Fails if buffer size was exceeded */
+	assert( pos <= m->size + end_frame_extra );
+	assert( m->channels == 2 );
+
+	out [14] += delta_l * delta_unit - delta2_l;
+	out [15] += delta_r * delta_unit - delta2_r;
+	out [16] += delta2_l;
+	out [17] += delta2_r;
+}
+
+void blip_add_deltas_stereo( blip_t* m, unsigned const times [], int const deltas [] [2], int count )
+{
+	fixed_t const factor = m->factor;
+	fixed_t const offset = m->offset;
+	int const avail = m->avail;
+	add_step_stereo_t const add_step_stereo = m->add_step_stereo;
+	int const phase_shift = frac_bits - phase_bits;
+	int i;
+
+	assert( m->channels == 2 );
+
+	for ( i = 0; i < count; i++ )
+	{
+		unsigned fixed = (unsigned) ((times [i] * factor + offset) >> pre_shift);
+		int const pos = avail + (fixed >> frac_bits);
+		buf_t* out = ring_sample( m, pos );
+
+		int phase = fixed >> phase_shift & (phase_count - 1);
+
+		int interp = fixed >> (phase_shift - delta_bits) & (delta_unit - 1);
+		int delta_l = deltas [i] [0];
+		int delta_r = deltas [i] [1];
+		int delta2_l = (delta_l * interp) >> delta_bits;
+		int delta2_r = (delta_r * interp) >> delta_bits;
+		delta_l -= delta2_l;
+		delta_r -= delta2_r;
+
+		/* Fails if buffer size was exceeded */
+		assert( pos <= m->size + end_frame_extra );
+
+		add_step_stereo( out, phase, delta_l, delta2_l, delta_r, delta2_r );
+	}
+}
+
+void blip_add_deltas_stereo_fast( blip_t* m, unsigned const times [], int const deltas [] [2], int count )
+{
+	fixed_t const factor = m->factor;
+	fixed_t const offset = m->offset;
+	int const avail = m->avail;
+	int i;
+
+	assert( m->channels == 2 );
+
+	for ( i = 0; i < count; i++ )
+	{
+		unsigned fixed = (unsigned) ((times [i] * factor + offset) >> pre_shift);
+		int const pos = avail + (fixed >> frac_bits);
+		buf_t* out = ring_sample( m, pos );
+
+		int interp = fixed >> (frac_bits - delta_bits) & (delta_unit - 1);
+		int const delta_l = deltas [i] [0];
+		int const delta_r = deltas [i] [1];
+		int delta2_l = delta_l * interp;
+		int delta2_r = delta_r * interp;
+
+		/* Fails if buffer size was exceeded */
+		assert( pos <= m->size + end_frame_extra );
+
+		out [14] += delta_l * delta_unit - delta2_l;
+		out [15] += delta_r * delta_unit - delta2_r;
+		out [16] += delta2_l;
+		out [17] += delta2_r;
+	}
+}
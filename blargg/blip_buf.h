@@ -18,6 +18,11 @@ so that there are blip_max_ratio clocks per sample. Returns pointer to new
 buffer, or NULL if insufficient memory. */
 blip_t* blip_new( int sample_count );
 
+/** Same as blip_new(), but creates a stereo buffer that holds left and right
+samples interleaved. Use the *_stereo functions to add deltas to and read
+samples from it. */
+blip_t* blip_new_stereo( int sample_count );
+
 /** Sets approximate input clock rate and output sample rate. For every
 clock_rate input clocks, approximately sample_rate samples are generated. */
 void blip_set_rates( blip_t*, double clock_rate, double sample_rate );
@@ -35,6 +40,22 @@ void blip_add_delta( blip_t*, unsigned int clock_time, int delta );
 /** Same as blip_add_delta(), but uses faster, lower-quality synthesis. */
 void blip_add_delta_fast( blip_t*, unsigned int clock_time, int delta );
 
+/** Adds a pair of left/right deltas into a stereo buffer at specified clock
+time. Resampling is only calculated once for both channels. */
+void blip_add_delta_stereo( blip_t*, unsigned int clock_time, int delta_l, int delta_r );
+
+/** Same as blip_add_delta_stereo(), but uses faster, lower-quality synthesis. */
+void blip_add_delta_stereo_fast( blip_t*, unsigned int clock_time, int delta_l, int delta_r );
+
+/** Same as calling blip_add_delta_stereo() for each of the count clock times
+and left/right delta pairs, but faster as the setup is only done once. */
+void blip_add_deltas_stereo( blip_t*, unsigned int const clock_times [],
+		int const deltas [] [2], int count );
+
+/** Same as blip_add_deltas_stereo(), but uses faster, lower-quality synthesis. */
+void blip_add_deltas_stereo_fast( blip_t*, unsigned int const clock_times [],
+		int const deltas [] [2], int count );
+
 /** Length of time frame, in clocks, needed to make sample_count additional
 samples available. */
 int blip_clocks_needed( const blip_t*, int sample_count );
@@ -49,6 +70,14 @@ frame specified. Deltas can have been added slightly past clock_duration (up to
 however many clocks there are in two output samples). */
 void blip_end_frame( blip_t*, unsigned int clock_duration );
 
+/** Adds the samples made available in src by the last blip_end_frame(), and
+the deltas pending after them, to the newest samples of dst, then removes them
+from src. Both must use the same rates and number of channels, and must have
+started the time frame at the same offset, see blip_load_tail(). This lets
+deltas be added to separate buffers, such as on separate threads, and then be
+read out of one. */
+void blip_mix( blip_t* dst, blip_t* src );
+
 /** Number of buffered samples available for reading. */
 int blip_samples_avail( const blip_t* );
 
@@ -58,6 +87,52 @@ interleaving of two buffers into a stereo sample stream. Outputs 16-bit signed
 samples. Returns number of samples actually read.  */
 int blip_read_samples( blip_t*, short out [], int count, int stereo );
 
+/** Reads and removes at most 'count' stereo samples from a stereo buffer and
+writes them to 'out' as interleaved left/right pairs, so 'out' must have room
+for count*2 elements. Returns number of stereo samples actually read. */
+int blip_read_samples_stereo( blip_t*, short out [], int count );
+
+/** Same as blip_read_samples(), but writes 32-bit samples that aren't clamped
+to 16 bits. */
+int blip_read_samples_s32( blip_t*, int out [], int count, int stereo );
+
+/** Same as blip_read_samples_s32(), but writes floats where 1.0 is 16-bit full
+scale. */
+int blip_read_samples_f32( blip_t*, float out [], int count, int stereo );
+
+/** Same as blip_read_samples_stereo(), but writes 32-bit samples that aren't
+clamped to 16 bits. Left and right samples are written to every step'th element
+of out_l and out_r, so out_r = out_l + 1 and step = 2 interleaves them, while
+step = 1 writes them to separate arrays. */
+int blip_read_samples_stereo_s32( blip_t*, int out_l [], int out_r [], int step, int count );
+
+/** Same as blip_read_samples_stereo_s32(), but writes floats where 1.0 is
+16-bit full scale. */
+int blip_read_samples_stereo_f32( blip_t*, float out_l [], float out_r [], int step, int count );
+
+enum { /** Number of samples after the available ones that deltas can still
+be pending in at the end of a time frame. */
+blip_tail_samples = 18 };
+
+/** State needed to continue output after the samples available at the end of
+a time frame, see blip_save_tail(). */
+typedef struct blip_tail_t
+{
+	unsigned long long offset;
+	int integrator [2];
+	int samples [blip_tail_samples * 2];
+} blip_tail_t;
+
+/** Saves the time offset, the integrators as they'll be after all available
+samples have been read, and the deltas pending past the available samples.
+Must be called at the end of a time frame, after blip_end_frame() and before
+adding more deltas. */
+void blip_save_tail( const blip_t*, blip_tail_t* out );
+
+/** Clears buffer and restores state saved by blip_save_tail(), so that output
+continues seamlessly from the end of the saved time frame. */
+void blip_load_tail( blip_t*, const blip_tail_t* in );
+
 /** Frees buffer. No effect if NULL is passed. */
 void blip_delete( blip_t* );
 
@@ -2,47 +2,52 @@
 #include "blargg/blip_buf.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 enum { VOLUME_MAX = 0x200 * 2 - 1 };
 
+/* blip_wrap_state_t is copied to and from blip_tail_t. */
+typedef char blip_wrap_state_check[((int) BLIP_WRAP_STATE_SAMPLES == (int) blip_tail_samples) ? 1 : -1];
+
 struct blip_wrap_t
 {
-    blip_t* buf[2];
+    blip_t* buf; /* stereo, left and right are interleaved, unless mono. */
     int volume;
+    int mono;
 };
 
-blip_wrap_t* blip_wrap_new(double sample_rate)
+static blip_wrap_t* blip_wrap_new_channels(double sample_rate, int mono)
 {
     blip_wrap_t* b = malloc(sizeof(*b));
     if (b) {
         b->volume = 0;
-        b->buf[0] = blip_new(sample_rate / 10);
-        b->buf[1] = blip_new(sample_rate / 10);
-
-        if (!b->buf[0] || !b->buf[1]) {
-            if (b->buf[0]) {
-                free(b->buf[0]); b->buf[0] = NULL;
-            }
-            if (b->buf[1]) {
-                free(b->buf[1]); b->buf[1] = NULL;
-            }
+        b->mono = mono;
+        b->buf = mono ? blip_new(sample_rate / 10) : blip_new_stereo(sample_rate / 10);
+
+        if (!b->buf) {
             free(b); b = NULL;
         }
     }
     return b;
 }
 
+blip_wrap_t* blip_wrap_new(double sample_rate)
+{
+    return blip_wrap_new_channels(sample_rate, 0);
+}
+
+blip_wrap_t* blip_wrap_new_mono(double sample_rate)
+{
+    return blip_wrap_new_channels(sample_rate, 1);
+}
+
 void blip_wrap_delete(blip_wrap_t* b)
 {
     if (b)
     {
-        if (b->buf[0])
-        {
-            blip_delete(b->buf[0]);
-        }
-        if (b->buf[1])
+        if (b->buf)
         {
-            blip_delete(b->buf[1]);
+            blip_delete(b->buf);
         }
         free(b);
     }
@@ -50,60 +55,120 @@ void blip_wrap_delete(blip_wrap_t* b)
 
 int blip_wrap_set_rates(blip_wrap_t* b, double clock_rate, double sample_rate)
 {
-    blip_set_rates(b->buf[0], clock_rate, sample_rate);
-    blip_set_rates(b->buf[1], clock_rate, sample_rate);
+    blip_set_rates(b->buf, clock_rate, sample_rate);
     return 0;
 }
 
 void blip_wrap_clear(blip_wrap_t* b)
 {
-    blip_clear(b->buf[0]);
-    blip_clear(b->buf[1]);
+    blip_clear(b->buf);
 }
 
-void blip_wrap_add_delta(blip_wrap_t* b, unsigned clock_time, int delta, int lr)
+void blip_wrap_add_delta(blip_wrap_t* b, unsigned clock_time, int delta_l, int delta_r)
 {
-    blip_add_delta(b->buf[lr], clock_time, delta);
+    if (b->mono)
+    {
+        blip_add_delta(b->buf, clock_time, delta_l);
+    }
+    else
+    {
+        blip_add_delta_stereo(b->buf, clock_time, delta_l, delta_r);
+    }
 }
 
-void blip_wrap_add_delta_fast(blip_wrap_t* b, unsigned clock_time, int delta, int lr)
+void blip_wrap_add_delta_fast(blip_wrap_t* b, unsigned clock_time, int delta_l, int delta_r)
 {
-    blip_add_delta_fast(b->buf[lr], clock_time, delta);
+    if (b->mono)
+    {
+        blip_add_delta_fast(b->buf, clock_time, delta_l);
+    }
+    else
+    {
+        blip_add_delta_stereo_fast(b->buf, clock_time, delta_l, delta_r);
+    }
+}
+
+void blip_wrap_add_deltas(blip_wrap_t* b, const unsigned clock_times[], const int deltas[][2], unsigned count)
+{
+    if (b->mono)
+    {
+        for (unsigned i = 0; i < count; i++)
+        {
+            blip_add_delta(b->buf, clock_times[i], deltas[i][0]);
+        }
+    }
+    else
+    {
+        blip_add_deltas_stereo(b->buf, clock_times, deltas, count);
+    }
+}
+
+void blip_wrap_add_deltas_fast(blip_wrap_t* b, const unsigned clock_times[], const int deltas[][2], unsigned count)
+{
+    if (b->mono)
+    {
+        for (unsigned i = 0; i < count; i++)
+        {
+            blip_add_delta_fast(b->buf, clock_times[i], deltas[i][0]);
+        }
+    }
+    else
+    {
+        blip_add_deltas_stereo_fast(b->buf, clock_times, deltas, count);
+    }
 }
 
 int blip_wrap_clocks_needed(const blip_wrap_t* b, int sample_count)
 {
-    return blip_clocks_needed(b->buf[0], sample_count / 2);
+    return blip_clocks_needed(b->buf, b->mono ? sample_count : sample_count / 2);
 }
 
 void blip_wrap_end_frame(blip_wrap_t* b, unsigned clock_duration)
 {
-    blip_end_frame(b->buf[0], clock_duration);
-    blip_end_frame(b->buf[1], clock_duration);
+    blip_end_frame(b->buf, clock_duration);
+}
+
+void blip_wrap_mix(blip_wrap_t* dst, blip_wrap_t* src)
+{
+    blip_mix(dst->buf, src->buf);
 }
 
 int blip_wrap_samples_avail(const blip_wrap_t* b)
 {
-    return blip_samples_avail(b->buf[0]) * 2;
+    return blip_samples_avail(b->buf) * (b->mono ? 1 : 2);
 }
 
 int blip_wrap_read_samples(blip_wrap_t* b, short out[], int count)
 {
-    blip_read_samples(b->buf[0], out + 0, count / 2, 1);
-    return blip_read_samples(b->buf[1], out + 1, count / 2, 1) * 2;
+    if (b->mono)
+    {
+        return blip_read_samples(b->buf, out, count, 0);
+    }
+    return blip_read_samples_stereo(b->buf, out, count / 2) * 2;
+}
+
+int blip_wrap_read_samples_s32(blip_wrap_t* b, int out_l[], int out_r[], int step, int count)
+{
+    if (b->mono)
+    {
+        return blip_read_samples_s32(b->buf, out_l, count, step == 2);
+    }
+    return blip_read_samples_stereo_s32(b->buf, out_l, out_r, step, count / 2) * 2;
+}
+
+int blip_wrap_read_samples_f32(blip_wrap_t* b, float out_l[], float out_r[], int step, int count)
+{
+    if (b->mono)
+    {
+        return blip_read_samples_f32(b->buf, out_l, count, step == 2);
+    }
+    return blip_read_samples_stereo_f32(b->buf, out_l, out_r, step, count / 2) * 2;
 }
 
-int blip_apply_volume_to_sample(blip_wrap_t* b, int sample, float volume)
+int blip_wrap_volume_to_gain(const blip_wrap_t* b, float volume)
 {
-#ifdef __NDS__
-    // disable floats on ds as they're emulated, aka, slow!
-    // these shifts are equivelent to the below mult and divide
-    return (sample << 15) >> 10;
-    // return (((sample << 15) - sample) >> 10) + sample;
-    // return sample * INT16_MAX / VOLUME_MAX;
-#else
-    return sample * b->volume / VOLUME_MAX * volume;
-#endif
+    // only called when a volume changes, so floats are fine here.
+    return (int)((double)b->volume * volume * 0x10000 / VOLUME_MAX + 0.5);
 }
 
 void blip_wrap_set_volume(blip_wrap_t* b, float volume)
@@ -111,6 +176,28 @@ void blip_wrap_set_volume(blip_wrap_t* b, float volume)
     b->volume = INT16_MAX * volume;
 }
 
+void blip_wrap_save_state(const blip_wrap_t* b, blip_wrap_state_t* state)
+{
+    blip_tail_t tail;
+    blip_save_tail(b->buf, &tail);
+
+    state->offset = tail.offset;
+    state->integrator[0] = tail.integrator[0];
+    state->integrator[1] = tail.integrator[1];
+    memcpy(state->samples, tail.samples, sizeof(state->samples));
+}
+
+void blip_wrap_load_state(blip_wrap_t* b, const blip_wrap_state_t* state)
+{
+    blip_tail_t tail;
+    tail.offset = state->offset;
+    tail.integrator[0] = state->integrator[0];
+    tail.integrator[1] = state->integrator[1];
+    memcpy(tail.samples, state->samples, sizeof(tail.samples));
+
+    blip_load_tail(b->buf, &tail);
+}
+
 // only available when using blip_buffer.cpp
 void blip_wrap_set_bass(blip_wrap_t* b, int frequency)
 {
@@ -3,20 +3,53 @@
 
 enum { VOLUME_MIN = -0x200 };
 enum { VOLUME_MAX = +0x200 - 1 };
+// same as buffer_extra in Blip_Buffer.cpp, deltas can be pending this far
+// past the available samples.
+enum { BUFFER_EXTRA = blip_widest_impulse_ + 2 };
 
 
 struct blip_wrap_t
 {
-    Blip_Buffer buf[2];
+    Blip_Buffer buf[2]; /* only the first is used when mono. */
+    bool mono;
     Blip_Synth<blip_med_quality, VOLUME_MAX - VOLUME_MIN> synth_med;
     Blip_Synth<blip_good_quality, VOLUME_MAX - VOLUME_MIN> synth_good;
 };
 
+// Blip_Buffer::read_samples() only outputs clamped shorts, so read with
+// Blip_Reader which gives the unclamped sample.
+template<typename T>
+static long read_unclamped(Blip_Buffer& buf, T out[], int step, long count, T scale)
+{
+    count = count < buf.samples_avail() ? count : buf.samples_avail();
+
+    Blip_Reader reader;
+    const int bass_shift = reader.begin(buf);
+    for (long n = 0; n < count; n++)
+    {
+        out[n * step] = (T)reader.read() * scale;
+        reader.next(bass_shift);
+    }
+    reader.end(buf);
+    buf.remove_samples(count);
+
+    return count;
+}
+
 extern "C" {
 
 blip_wrap_t* blip_wrap_new(double sample_rate)
 {
-    return new blip_wrap_t();
+    blip_wrap_t* b = new blip_wrap_t();
+    b->mono = false;
+    return b;
+}
+
+blip_wrap_t* blip_wrap_new_mono(double)
+{
+    blip_wrap_t* b = new blip_wrap_t();
+    b->mono = true;
+    return b;
 }
 
 void blip_wrap_delete(blip_wrap_t* b)
@@ -31,7 +64,8 @@ int blip_wrap_set_rates(blip_wrap_t* b, double clock_rate, double sample_rate)
     if (b->buf[0].set_sample_rate(sample_rate)) {
         return -1;
     }
-    if (b->buf[1].set_sample_rate(sample_rate)) {
+    // the second buffer is never allocated when mono.
+    if (!b->mono && b->buf[1].set_sample_rate(sample_rate)) {
         return -1;
     }
 
@@ -44,41 +78,120 @@ void blip_wrap_clear(blip_wrap_t* b)
     b->buf[1].clear();
 }
 
-void blip_wrap_add_delta(blip_wrap_t* b, unsigned clock_time, int delta, int lr)
+void blip_wrap_add_delta(blip_wrap_t* b, unsigned clock_time, int delta_l, int delta_r)
 {
-    b->synth_good.offset_inline(clock_time, delta, &b->buf[lr]);
+    if (delta_l)
+    {
+        b->synth_good.offset_inline(clock_time, delta_l, &b->buf[0]);
+    }
+    if (delta_r && !b->mono)
+    {
+        b->synth_good.offset_inline(clock_time, delta_r, &b->buf[1]);
+    }
 }
 
-void blip_wrap_add_delta_fast(blip_wrap_t* b, unsigned clock_time, int delta, int lr)
+void blip_wrap_add_delta_fast(blip_wrap_t* b, unsigned clock_time, int delta_l, int delta_r)
 {
-    b->synth_med.offset_inline(clock_time, delta, &b->buf[lr]);
+    if (delta_l)
+    {
+        b->synth_med.offset_inline(clock_time, delta_l, &b->buf[0]);
+    }
+    if (delta_r && !b->mono)
+    {
+        b->synth_med.offset_inline(clock_time, delta_r, &b->buf[1]);
+    }
+}
+
+void blip_wrap_add_deltas(blip_wrap_t* b, const unsigned clock_times[], const int deltas[][2], unsigned count)
+{
+    for (unsigned i = 0; i < count; i++)
+    {
+        blip_wrap_add_delta(b, clock_times[i], deltas[i][0], deltas[i][1]);
+    }
+}
+
+void blip_wrap_add_deltas_fast(blip_wrap_t* b, const unsigned clock_times[], const int deltas[][2], unsigned count)
+{
+    for (unsigned i = 0; i < count; i++)
+    {
+        blip_wrap_add_delta_fast(b, clock_times[i], deltas[i][0], deltas[i][1]);
+    }
 }
 
 int blip_wrap_clocks_needed(const blip_wrap_t* b, int sample_count)
 {
-    return b->buf[0].count_clocks(sample_count / 2);
+    return b->buf[0].count_clocks(b->mono ? sample_count : sample_count / 2);
 }
 
 void blip_wrap_end_frame(blip_wrap_t* b, unsigned clock_duration)
 {
     b->buf[0].end_frame(clock_duration);
-    b->buf[1].end_frame(clock_duration);
+    if (!b->mono)
+    {
+        b->buf[1].end_frame(clock_duration);
+    }
+}
+
+void blip_wrap_mix(blip_wrap_t* dst, blip_wrap_t* src)
+{
+    for (int i = 0; i < (dst->mono ? 1 : 2); i++)
+    {
+        Blip_Buffer& out = dst->buf[i];
+        Blip_Buffer& in = src->buf[i];
+        const long avail = in.samples_avail();
+        const long count = avail + BUFFER_EXTRA;
+        const long start = out.samples_avail() - avail;
+
+        assert(start >= 0);
+        for (long n = 0; n < count; n++)
+        {
+            out.buffer_[start + n] += in.buffer_[n];
+            in.buffer_[n] = 0;
+        }
+
+        // keep the fraction so that it stays aligned with dst.
+        in.offset_ &= (1UL << BLIP_BUFFER_ACCURACY) - 1;
+    }
 }
 
 int blip_wrap_samples_avail(const blip_wrap_t* b)
 {
-    return b->buf[0].samples_avail() * 2;
+    return b->buf[0].samples_avail() * (b->mono ? 1 : 2);
 }
 
 int blip_wrap_read_samples(blip_wrap_t* b, short out[], int count)
 {
+    if (b->mono)
+    {
+        return b->buf[0].read_samples(out, count, 0);
+    }
     b->buf[0].read_samples(out + 0, count / 2, 1);
     return b->buf[1].read_samples(out + 1, count / 2, 1) * 2;
 }
 
-int blip_apply_volume_to_sample(blip_wrap_t*, int sample, float volume)
+int blip_wrap_read_samples_s32(blip_wrap_t* b, int out_l[], int out_r[], int step, int count)
 {
-    return sample * volume;
+    if (b->mono)
+    {
+        return read_unclamped<int>(b->buf[0], out_l, step, count, 1);
+    }
+    read_unclamped<int>(b->buf[0], out_l, step, count / 2, 1);
+    return read_unclamped<int>(b->buf[1], out_r, step, count / 2, 1) * 2;
+}
+
+int blip_wrap_read_samples_f32(blip_wrap_t* b, float out_l[], float out_r[], int step, int count)
+{
+    if (b->mono)
+    {
+        return read_unclamped<float>(b->buf[0], out_l, step, count, 1.0F / 32768);
+    }
+    read_unclamped<float>(b->buf[0], out_l, step, count / 2, 1.0F / 32768);
+    return read_unclamped<float>(b->buf[1], out_r, step, count / 2, 1.0F / 32768) * 2;
+}
+
+int blip_wrap_volume_to_gain(const blip_wrap_t*, float volume)
+{
+    return (int)(volume * 0x10000 + 0.5);
 }
 
 void blip_wrap_set_volume(blip_wrap_t* b, float volume)
@@ -87,11 +200,62 @@ void blip_wrap_set_volume(blip_wrap_t* b, float volume)
     b->synth_good.volume(volume);
 }
 
+void blip_wrap_save_state(const blip_wrap_t* b, blip_wrap_state_t* state)
+{
+    if (b->mono)
+    {
+        state->integrator[1] = 0;
+        for (int n = 0; n < BLIP_WRAP_STATE_SAMPLES; n++)
+        {
+            state->samples[n][1] = 0;
+        }
+    }
+
+    for (int i = 0; i < (b->mono ? 1 : 2); i++)
+    {
+        Blip_Buffer& buf = const_cast<Blip_Buffer&>(b->buf[i]);
+        const long avail = buf.samples_avail();
+
+        // run the reader over the available samples without removing them.
+        Blip_Reader reader;
+        const int bass_shift = reader.begin(buf);
+        for (long n = 0; n < avail; n++)
+        {
+            reader.next(bass_shift);
+        }
+
+        state->offset = buf.offset_ & ((1UL << BLIP_BUFFER_ACCURACY) - 1);
+        state->integrator[i] = reader.read_raw();
+        for (int n = 0; n < BLIP_WRAP_STATE_SAMPLES; n++)
+        {
+            state->samples[n][i] = buf.buffer_[avail + n];
+        }
+    }
+}
+
+void blip_wrap_load_state(blip_wrap_t* b, const blip_wrap_state_t* state)
+{
+    for (int i = 0; i < (b->mono ? 1 : 2); i++)
+    {
+        Blip_Buffer& buf = b->buf[i];
+        buf.clear();
+        buf.offset_ = state->offset;
+        buf.reader_accum = state->integrator[i];
+        for (int n = 0; n < BLIP_WRAP_STATE_SAMPLES; n++)
+        {
+            buf.buffer_[n] = state->samples[n][i];
+        }
+    }
+}
+
 // only available when using blip_buffer.cpp
 void blip_wrap_set_bass(blip_wrap_t* b, int frequency)
 {
     b->buf[0].bass_freq(frequency);
-    b->buf[1].bass_freq(frequency);
+    if (!b->mono)
+    {
+        b->buf[1].bass_freq(frequency);
+    }
 }
 
 void blip_wrap_set_treble(blip_wrap_t* b, double treble_db)
@@ -7,19 +7,47 @@ extern "C" {
 
 typedef struct blip_wrap_t blip_wrap_t;
 
+enum { BLIP_WRAP_STATE_SAMPLES = 18 };
+
+// state needed to continue output seamlessly from the end of a frame.
+// this is only compatible with the backend that saved it.
+typedef struct blip_wrap_state_t
+{
+    unsigned long long offset; /* resampled time past the available samples. */
+    int integrator[2]; /* left and right, once all available samples are read. */
+    int samples[BLIP_WRAP_STATE_SAMPLES][2]; /* pending deltas after the available samples. */
+} blip_wrap_state_t;
+
 blip_wrap_t* blip_wrap_new(double sample_rate);
+// only the left delta is used and samples are read out as mono,
+// out_r is unused when reading s32 / f32.
+blip_wrap_t* blip_wrap_new_mono(double sample_rate);
 
 int blip_wrap_set_rates(blip_wrap_t*, double clock_rate, double sample_rate);
 void blip_wrap_clear(blip_wrap_t*);
-void blip_wrap_add_delta(blip_wrap_t*, unsigned clock_time, int delta, int lr);
-void blip_wrap_add_delta_fast(blip_wrap_t*, unsigned clock_time, int delta, int lr);
+void blip_wrap_add_delta(blip_wrap_t*, unsigned clock_time, int delta_l, int delta_r);
+void blip_wrap_add_delta_fast(blip_wrap_t*, unsigned clock_time, int delta_l, int delta_r);
+// same as calling the above for each clock time and left/right delta pair.
+void blip_wrap_add_deltas(blip_wrap_t*, const unsigned clock_times[], const int deltas[][2], unsigned count);
+void blip_wrap_add_deltas_fast(blip_wrap_t*, const unsigned clock_times[], const int deltas[][2], unsigned count);
 int blip_wrap_clocks_needed(const blip_wrap_t*, int sample_count);
 void blip_wrap_end_frame(blip_wrap_t*, unsigned clock_duration);
+// adds the samples src made available in the last blip_wrap_end_frame(), and the
+// deltas pending after them, into dst, then empties src. both must have the same
+// rates and volume, and have been aligned with blip_wrap_load_state().
+void blip_wrap_mix(blip_wrap_t* dst, blip_wrap_t* src);
 int blip_wrap_samples_avail(const blip_wrap_t*);
 int blip_wrap_read_samples(blip_wrap_t*, short out [], int count);
+// same as above but unclamped, left / right are written to every step'th element.
+int blip_wrap_read_samples_s32(blip_wrap_t*, int out_l[], int out_r[], int step, int count);
+int blip_wrap_read_samples_f32(blip_wrap_t*, float out_l[], float out_r[], int step, int count);
 void blip_wrap_delete(blip_wrap_t*);
-int blip_apply_volume_to_sample(blip_wrap_t*, int sample, float volume);
+// returns volume as a 16.16 fixed-point gain to multiply samples by.
+int blip_wrap_volume_to_gain(const blip_wrap_t*, float volume);
 void blip_wrap_set_volume(blip_wrap_t*, float volume);
+// only valid after blip_wrap_end_frame(), loading removes all available samples.
+void blip_wrap_save_state(const blip_wrap_t*, blip_wrap_state_t* state);
+void blip_wrap_load_state(blip_wrap_t*, const blip_wrap_state_t* state);
 
 // only available when using blip_buffer.cpp
 void blip_wrap_set_bass(blip_wrap_t*, int frequency);
@@ -7,11 +7,48 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+    #include <intrin.h>
+#endif
 #if defined(GB_APU_HAS_MATH_H) && GB_APU_HAS_MATH_H
     #include <math.h>
 #endif
 
 #define FIFO_CAPACITY 8U /* ensure this is unsigned! */
+#define EVENT_LOG_CAPACITY 1024U
+
+// set to 0 to build without agb support, see GB_APU_AGB in CMakeLists.txt.
+#ifndef GB_APU_AGB
+    #define GB_APU_AGB 1
+#endif
+
+// set to 0 to build without the output ring, see GB_APU_OUTPUT_RING in CMakeLists.txt.
+#ifndef GB_APU_OUTPUT_RING
+    #define GB_APU_OUTPUT_RING 1
+#endif
+
+// the output ring is shared between threads, so it needs atomics. gcc, clang
+// and msvc have builtins, otherwise c11 atomics are used.
+#if GB_APU_OUTPUT_RING && !defined(__GNUC__) && !defined(__clang__) && !defined(_MSC_VER)
+    #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+        #include <stdatomic.h>
+        #define APU_ATOMIC _Atomic
+    #else
+        #error "the output ring needs atomics, build with GB_APU_OUTPUT_RING=0"
+    #endif
+#endif
+
+#ifndef APU_ATOMIC
+    #define APU_ATOMIC
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define APU_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+    #define APU_FORCE_INLINE __forceinline
+#else
+    #define APU_FORCE_INLINE inline
+#endif
 
 typedef struct GbApuFrameSequencer
 {
@@ -19,6 +56,15 @@ typedef struct GbApuFrameSequencer
     uint8_t _padding[3];
 } GbApuFrameSequencer;
 
+// used when the frame sequencer is clocked internally, see apu_set_frame_sequencer_internal().
+typedef struct GbApuFrameSequencerTimer
+{
+    uint32_t next_time; /* time of the next div falling edge. */
+    uint32_t period; /* time between each falling edge. */
+    bool enabled;
+    uint8_t _padding[3];
+} GbApuFrameSequencerTimer;
+
 typedef struct GbApuLen
 {
     uint16_t counter;
@@ -80,6 +126,79 @@ typedef struct GbApuFifo
     uint8_t _padding[1];
 } GbApuFifo;
 
+typedef struct GbApuSnapshot
+{
+    uint8_t* data; /* runs of the savestate xor'd with its keyframe. */
+    unsigned size;
+    unsigned capacity;
+    unsigned keyframe; /* index into keyframes. */
+} GbApuSnapshot;
+
+typedef struct GbApuSnapshotKeyframe
+{
+    uint8_t* data; /* allocated on first use, then kept for reuse. */
+    unsigned refs; /* snapshots relative to this keyframe, free when 0. */
+} GbApuSnapshotKeyframe;
+
+typedef struct GbApuSnapshotRing
+{
+    GbApuSnapshot* slots;
+    GbApuSnapshotKeyframe* keyframes; /* slot_count entries, every live one is used by a snapshot. */
+    uint8_t* scratch; /* snapshots are encoded here before being copied. */
+    unsigned slot_count;
+    unsigned newest; /* slot index of the last push. */
+    unsigned count;
+    unsigned keyframe; /* keyframe of the last push. */
+} GbApuSnapshotRing;
+
+// samples read out by apu_peek_samples() that haven't been consumed yet.
+typedef struct GbApuPeekBuffer
+{
+    short* samples;
+    int capacity;
+    int start; /* index of the first unconsumed sample. */
+    int count;
+} GbApuPeekBuffer;
+
+// single producer / single consumer ring, see apu_output_ring_init().
+// head and tail count every sample ever written / read, wrapping is fine as
+// the capacity is a power of 2.
+typedef struct GbApuOutputRing
+{
+    short* samples;
+    unsigned capacity;
+    /* only written by the producer, apu_end_frame(). */
+    APU_ATOMIC unsigned head;
+    APU_ATOMIC unsigned overruns;
+    uint8_t _padding[64]; /* keep the consumer's fields on another cache line. */
+    /* only written by the consumer, apu_output_ring_read(). */
+    APU_ATOMIC unsigned tail;
+    APU_ATOMIC unsigned underruns;
+} GbApuOutputRing;
+
+// nr50 / nr51 writes aren't applied to enabled channels until they next sync,
+// see channel_apply_pending_gain().
+typedef struct GbApuPendingGain
+{
+    uint32_t time; /* time of the write. */
+    uint8_t nr50; /* values before the write, used up until time. */
+    uint8_t nr51;
+    bool pending;
+    uint8_t _padding[1];
+} GbApuPendingGain;
+
+// deltas waiting to be added to blip, see apu_set_event_log().
+typedef struct GbApuEventLog
+{
+    unsigned* time;
+    int (*delta)[2]; /* left and right. */
+    unsigned count;
+    unsigned capacity;
+} GbApuEventLog;
+
+// one log per channel, plus one for deltas added with add_delta_fast().
+enum { EVENT_LOG_FAST = 6, EVENT_LOG_COUNT = 7 };
+
 typedef struct GbApuChannel
 {
     uint32_t clock; /* clock used for blip_buf. */
@@ -103,16 +222,38 @@ struct GbApu
     uint16_t agb_soundcnt;
     uint16_t agb_soundbias;
     uint8_t io[0x50]; /* 0x30 + AGB wave ram (0x20). */
+    struct GbApuPendingGain pending_gain[4]; /* every psg channel has one. */
+    struct GbApuFrameSequencerTimer frame_sequencer_timer;
     /* end. */
 
     blip_wrap_t* blip;
+    blip_wrap_t* stem[6]; /* per channel output, NULL unless enabled, see apu_set_stem_output(). */
     float channel_volume[6];
+    float master_volume;
+    int gain[6][2]; /* left and right output gain, see update_gains(). */
+    unsigned period[4]; /* psg channel frequency timer reload, see channel_update_period(). */
+    unsigned ultrasonic_period; /* waveforms shorter than this output their average, 0 = disabled. */
+    /* specialised for the type, set in apu_reset(). */
+    void (*sync_psg)(GbApu* apu, unsigned num, unsigned time);
+    void (*write_io)(GbApu* apu, unsigned addr, unsigned value, unsigned time);
+    void (*write_io_batch)(GbApu* apu, unsigned addr, unsigned value, unsigned time, unsigned* synced);
+    int wave_amp[16][2]; /* left and right output for each wave sample. */
+    bool wave_amp_dirty; /* wave_amp needs rebuilding before use. */
 #if defined(GB_APU_HAS_MATH_H) && GB_APU_HAS_MATH_H
     int capacitor_charge_factor; /*  */
     int capacitor[2]; /* left and right capacitors */
 #endif
+    struct GbApuSnapshotRing snapshots;
+    struct GbApuPeekBuffer peek;
+    struct GbApuOutputRing output_ring;
+    GbApuEventLog* event_log; /* NULL unless enabled, see apu_set_event_log(). */
+    apu_parallel_for parallel_for; /* NULL unless set, see apu_set_parallel_for(). */
+    void* parallel_user;
+    blip_wrap_t* parallel_blip[4]; /* each psg channel's output, mixed in apu_end_frame(). */
     enum GbApuType type;
     bool zombie_mode_enable;
+    bool audio_output_disabled;
+    bool mono; /* set in apu_init_mono(), only left is output. */
 };
 
 // APU (square1)
@@ -152,6 +293,7 @@ struct GbApu
 #define apu_array_size(a) (sizeof(a) / sizeof(a[0]))
 
 enum { CAPACITOR_SCALE = 15 };
+enum { GAIN_SCALE = 16 };
 
 static const double CHARGE_FACTOR[3] = {
     [GbApuFilter_NONE] = 1.0,
@@ -159,11 +301,24 @@ static const double CHARGE_FACTOR[3] = {
     [GbApuFilter_CGB] = 0.998943,
 };
 
-static const bool SQUARE_DUTY_CYCLES[4][8] = {
-    { 0, 0, 0, 0, 0, 0, 0, 1 }, // 12.5%
-    { 1, 0, 0, 0, 0, 0, 0, 1 }, // 25%
-    { 1, 0, 0, 0, 0, 1, 1, 1 }, // 50%
-    { 0, 1, 1, 1, 1, 1, 1, 0 }, // 75%
+// bit n is the output of step n of the duty cycle.
+static const uint8_t SQUARE_DUTY_CYCLES[4] = {
+    0x80, // 12.5% { 0, 0, 0, 0, 0, 0, 0, 1 }
+    0x81, // 25%   { 1, 0, 0, 0, 0, 0, 0, 1 }
+    0xE1, // 50%   { 1, 0, 0, 0, 0, 1, 1, 1 }
+    0x7E, // 75%   { 0, 1, 1, 1, 1, 1, 1, 0 }
+};
+
+// number of high steps in each duty cycle above.
+static const uint8_t SQUARE_DUTY_HIGH_COUNT[4] = { 1, 2, 4, 6 };
+
+// bit n is set if the output changes when stepping from n-1 to n.
+// this is the duty cycle xor'd with itself rotated left by 1.
+static const uint8_t SQUARE_DUTY_EDGES[4] = {
+    0x81, // 12.5%
+    0x82, // 25%
+    0x22, // 50%
+    0x82, // 75%
 };
 
 // multiply then shift down, eg 75% vol is ((v * 3) / 4)
@@ -179,6 +334,41 @@ static const uint8_t NOISE_DIVISOR[8] = {
     8, 16, 32, 48, 64, 80, 96, 112
 };
 
+// the lfsr after 2^n clocks, as an affine map over its 15 bits.
+// the result starts as [15] (the lfsr being 0), then [i] is xor'd in
+// for each bit i set in the old lfsr.
+// the 15-bit lfsr repeats every 32767 clocks, so 2^14 is the largest needed.
+static const uint16_t NOISE_JUMP_15BIT[15][16] = {
+    { 0x4000, 0x4001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080, 0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000 }, // 1
+    { 0x2000, 0x6000, 0x4001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080, 0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x6000 }, // 2
+    { 0x0800, 0x1800, 0x3000, 0x6000, 0x4001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080, 0x0100, 0x0200, 0x0400, 0x7800 }, // 4
+    { 0x0080, 0x0180, 0x0300, 0x0600, 0x0C00, 0x1800, 0x3000, 0x6000, 0x4001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x7F80 }, // 8
+    { 0x6000, 0x2001, 0x4003, 0x0006, 0x000C, 0x0018, 0x0030, 0x0060, 0x00C0, 0x0180, 0x0300, 0x0600, 0x0C00, 0x1800, 0x3000, 0x5FFF }, // 16
+    { 0x2800, 0x7800, 0x7001, 0x6002, 0x4005, 0x000A, 0x0014, 0x0028, 0x0050, 0x00A0, 0x0140, 0x0280, 0x0500, 0x0A00, 0x1400, 0x67FF }, // 32
+    { 0x0880, 0x1980, 0x3300, 0x6600, 0x4C01, 0x1802, 0x3004, 0x6008, 0x4011, 0x0022, 0x0044, 0x0088, 0x0110, 0x0220, 0x0440, 0x787F }, // 64
+    { 0x6080, 0x2181, 0x4303, 0x0606, 0x0C0C, 0x1818, 0x3030, 0x6060, 0x40C1, 0x0182, 0x0304, 0x0608, 0x0C10, 0x1820, 0x3040, 0x5F80 }, // 128
+    { 0x4800, 0x5801, 0x3002, 0x6004, 0x4009, 0x0012, 0x0024, 0x0048, 0x0090, 0x0120, 0x0240, 0x0480, 0x0900, 0x1200, 0x2400, 0x47FF }, // 256
+    { 0x2080, 0x6180, 0x4301, 0x0602, 0x0C04, 0x1808, 0x3010, 0x6020, 0x4041, 0x0082, 0x0104, 0x0208, 0x0410, 0x0820, 0x1040, 0x607F }, // 512
+    { 0x6800, 0x3801, 0x7003, 0x6006, 0x400D, 0x001A, 0x0034, 0x0068, 0x00D0, 0x01A0, 0x0340, 0x0680, 0x0D00, 0x1A00, 0x3400, 0x5800 }, // 1024
+    { 0x2880, 0x7980, 0x7301, 0x6602, 0x4C05, 0x180A, 0x3014, 0x6028, 0x4051, 0x00A2, 0x0144, 0x0288, 0x0510, 0x0A20, 0x1440, 0x6780 }, // 2048
+    { 0x6880, 0x3981, 0x7303, 0x6606, 0x4C0D, 0x181A, 0x3034, 0x6068, 0x40D1, 0x01A2, 0x0344, 0x0688, 0x0D10, 0x1A20, 0x3440, 0x587F }, // 4096
+    { 0x4880, 0x5981, 0x3302, 0x6604, 0x4C09, 0x1812, 0x3024, 0x6048, 0x4091, 0x0122, 0x0244, 0x0488, 0x0910, 0x1220, 0x2440, 0x4780 }, // 8192
+    { 0x4080, 0x4181, 0x0302, 0x0604, 0x0C08, 0x1810, 0x3020, 0x6040, 0x4081, 0x0102, 0x0204, 0x0408, 0x0810, 0x1020, 0x2040, 0x407F }, // 16384
+};
+
+// same as above for 7-bit mode, bits 7-13 are shifted out within 8 clocks
+// after which the lfsr repeats every 127 clocks, so 2^7 is the largest needed.
+static const uint16_t NOISE_JUMP_7BIT[8][16] = {
+    { 0x4040, 0x4041, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0000, 0x0080, 0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4040 }, // 1
+    { 0x2020, 0x6060, 0x4041, 0x0002, 0x0004, 0x0008, 0x0010, 0x0000, 0x0000, 0x0080, 0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x6060 }, // 2
+    { 0x0808, 0x1818, 0x3030, 0x6060, 0x4041, 0x0002, 0x0004, 0x0000, 0x0000, 0x0000, 0x0000, 0x0080, 0x0100, 0x0200, 0x0400, 0x7878 }, // 4
+    { 0x60E0, 0x21A1, 0x4343, 0x0606, 0x0C0C, 0x1818, 0x3030, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x5FDF }, // 8
+    { 0x2828, 0x78F8, 0x7171, 0x62E2, 0x4545, 0x0A0A, 0x1414, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x67E7 }, // 16
+    { 0x68E8, 0x39B9, 0x7373, 0x66E6, 0x4D4D, 0x1A1A, 0x3434, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x5858 }, // 32
+    { 0x48C8, 0x5959, 0x3232, 0x64E4, 0x4949, 0x1212, 0x2424, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x47C7 }, // 64
+    { 0x40C0, 0x4141, 0x0202, 0x0404, 0x0808, 0x1010, 0x2020, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x4040 }, // 128
+};
+
 static const uint8_t AGB_PSG_SHIFT_TABLE[4] = {
     2, // 25%
     1, // 50%
@@ -258,6 +448,7 @@ enum { AGB_ADDR_OFFSET = 0x60 };
 // this is used for 16 writes.
 enum { AGB_UNUSED_ADDR = 0x27 };
 
+#if GB_APU_AGB
 // translates agb addr to dmg addr.
 static const uint8_t AGB_ADDR_TRANSLATION[64] = {
     [0x60 - AGB_ADDR_OFFSET] = 0x10, // IO_SOUND1CNT_L
@@ -306,6 +497,7 @@ static const uint8_t AGB_ADDR_TRANSLATION[64] = {
     [0x9E - AGB_ADDR_OFFSET] = 0x3E, // IO_WAVE_RAM3_H
     [0x9F - AGB_ADDR_OFFSET] = 0x3F, // IO_WAVE_RAM3_H
 };
+#endif // GB_APU_AGB
 
 static const uint8_t IO_READ_VALUE_DMG_CGB[0x40] = {
     [0x10] = 0x80, // NR10
@@ -403,7 +595,7 @@ static inline bool apu_is_cgb(const GbApu* apu)
 
 static inline bool apu_is_agb(const GbApu* apu)
 {
-    return apu->type == GbApuType_AGB;
+    return GB_APU_AGB && apu->type == GbApuType_AGB;
 }
 
 static inline bool apu_is_enabled(const GbApu* apu)
@@ -468,24 +660,238 @@ static unsigned channel_get_frequency(const GbApu* apu, unsigned num)
     }
 }
 
-static inline void add_delta(GbApu* apu, GbApuChannel* c, unsigned clock_time, int sample, unsigned lr)
+// the period only changes on nrx3/nrx4 (nr43) writes and sweep updates, so
+// it's cached rather than decoded on every sync.
+static void channel_update_period(GbApu* apu, unsigned num)
+{
+    apu->period[num] = channel_get_frequency(apu, num);
+}
+
+static void channel_update_period_all(GbApu* apu)
+{
+    for (unsigned num = ChannelType_SQUARE0; num <= ChannelType_NOISE; num++)
+    {
+        channel_update_period(apu, num);
+    }
+}
+
+// adds all logged deltas to blip (and the stem) in one go.
+static void event_log_resolve_to(GbApu* apu, unsigned index, blip_wrap_t* blip)
+{
+    GbApuEventLog* log = &apu->event_log[index];
+
+    if (log->count)
+    {
+        const int (*delta)[2] = (const int (*)[2])log->delta;
+
+        if (index == EVENT_LOG_FAST)
+        {
+            blip_wrap_add_deltas_fast(blip, log->time, delta, log->count);
+            if (apu->stem[ChannelType_NOISE])
+            {
+                blip_wrap_add_deltas_fast(apu->stem[ChannelType_NOISE], log->time, delta, log->count);
+            }
+        }
+        else
+        {
+            blip_wrap_add_deltas(blip, log->time, delta, log->count);
+            if (apu->stem[index])
+            {
+                blip_wrap_add_deltas(apu->stem[index], log->time, delta, log->count);
+            }
+        }
+        log->count = 0;
+    }
+}
+
+static void event_log_resolve(GbApu* apu, unsigned index)
+{
+    event_log_resolve_to(apu, index, apu->blip);
+}
+
+static void event_log_resolve_all(GbApu* apu)
+{
+    if (apu->event_log)
+    {
+        for (unsigned i = 0; i < EVENT_LOG_COUNT; i++)
+        {
+            event_log_resolve(apu, i);
+        }
+    }
+}
+
+static void event_log_clear(GbApu* apu)
+{
+    if (apu->event_log)
+    {
+        for (unsigned i = 0; i < EVENT_LOG_COUNT; i++)
+        {
+            apu->event_log[i].count = 0;
+        }
+    }
+}
+
+// grows the log so that it can hold count more deltas, returns false on faliure.
+static bool event_log_reserve(GbApuEventLog* log, unsigned count)
+{
+    if (log->capacity - log->count >= count)
+    {
+        return true;
+    }
+
+    const unsigned capacity = log->count + count;
+
+    unsigned* time = realloc(log->time, sizeof(*log->time) * capacity);
+    if (!time)
+    {
+        return false;
+    }
+    log->time = time;
+
+    int (*delta)[2] = realloc(log->delta, sizeof(*log->delta) * capacity);
+    if (!delta)
+    {
+        return false;
+    }
+    log->delta = delta;
+
+    log->capacity = capacity;
+    return true;
+}
+
+static void event_log_free(GbApu* apu)
+{
+    if (apu->event_log)
+    {
+        for (unsigned i = 0; i < EVENT_LOG_COUNT; i++)
+        {
+            free(apu->event_log[i].time);
+            free(apu->event_log[i].delta);
+        }
+        free(apu->event_log);
+        apu->event_log = NULL;
+    }
+}
+
+static inline void event_log_add(GbApu* apu, unsigned index, unsigned clock_time, int delta_l, int delta_r)
+{
+    GbApuEventLog* log = &apu->event_log[index];
+
+    // the order deltas are added in doesn't matter, so a full log can be
+    // resolved early.
+    if (log->count == log->capacity)
+    {
+        event_log_resolve(apu, index);
+    }
+
+    log->time[log->count] = clock_time;
+    log->delta[log->count][0] = delta_l;
+    log->delta[log->count][1] = delta_r;
+    log->count++;
+}
+
+static inline void add_delta(GbApu* apu, GbApuChannel* c, unsigned clock_time, int left, int right)
+{
+    const int delta_l = left - c->amp[0];
+    const int delta_r = right - c->amp[1];
+    if (delta_l || delta_r) // same as (sample != amp)
+    {
+        const unsigned num = c - apu->channels;
+
+        if (apu->event_log)
+        {
+            event_log_add(apu, num, clock_time, delta_l, delta_r);
+        }
+        else
+        {
+            blip_wrap_add_delta(apu->blip, clock_time, delta_l, delta_r);
+            if (apu->stem[num])
+            {
+                blip_wrap_add_delta(apu->stem[num], clock_time, delta_l, delta_r);
+            }
+        }
+        c->amp[0] = left;
+        c->amp[1] = right;
+    }
+}
+
+static inline void add_delta_fast(GbApu* apu, GbApuChannel* c, unsigned clock_time, int left, int right)
 {
-    const int delta = sample - c->amp[lr];
-    if (delta) // same as (sample != amp)
+    const int delta_l = left - c->amp[0];
+    const int delta_r = right - c->amp[1];
+    if (delta_l || delta_r) // same as (sample != amp)
     {
-        blip_wrap_add_delta(apu->blip, clock_time, delta, lr);
-        c->amp[lr] += delta; // same as (amp = sample)
+        const unsigned num = c - apu->channels;
+
+        if (apu->event_log)
+        {
+            event_log_add(apu, EVENT_LOG_FAST, clock_time, delta_l, delta_r);
+        }
+        else
+        {
+            blip_wrap_add_delta_fast(apu->blip, clock_time, delta_l, delta_r);
+            if (apu->stem[num])
+            {
+                blip_wrap_add_delta_fast(apu->stem[num], clock_time, delta_l, delta_r);
+            }
+        }
+        c->amp[0] = left;
+        c->amp[1] = right;
     }
 }
 
-static inline void add_delta_fast(GbApu* apu, GbApuChannel* c, unsigned clock_time, int sample, unsigned lr)
+static inline unsigned apu_ctz(unsigned value)
 {
-    const int delta = sample - c->amp[lr];
-    if (delta) // same as (sample != amp)
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(value);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return index;
+#else
+    unsigned index = 0;
+    while (!(value & 0x1))
     {
-        blip_wrap_add_delta_fast(apu->blip, clock_time, delta, lr);
-        c->amp[lr] += delta; // same as (amp = sample)
+        value >>= 1;
+        index++;
     }
+    return index;
+#endif
+}
+
+#if GB_APU_OUTPUT_RING
+// used for the output ring, which is shared between threads.
+static inline unsigned atomic_load_acquire(const APU_ATOMIC unsigned* value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#elif defined(_MSC_VER)
+    return (unsigned)_InterlockedOr((volatile long*)value, 0);
+#else
+    return atomic_load_explicit((APU_ATOMIC unsigned*)value, memory_order_acquire);
+#endif
+}
+
+static inline void atomic_store_release(APU_ATOMIC unsigned* value, unsigned new_value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+#elif defined(_MSC_VER)
+    _InterlockedExchange((volatile long*)value, (long)new_value);
+#else
+    atomic_store_explicit(value, new_value, memory_order_release);
+#endif
+}
+#endif // GB_APU_OUTPUT_RING
+
+static inline unsigned rotate_right8(unsigned value, unsigned shift)
+{
+    return ((value >> shift) | (value << (8 - shift))) & 0xFF;
+}
+
+static inline bool square_duty_bit(unsigned duty, unsigned duty_index)
+{
+    return (SQUARE_DUTY_CYCLES[duty] >> duty_index) & 0x1;
 }
 
 static inline void clock_square(GbApuSquare* square, unsigned count)
@@ -522,19 +928,225 @@ static inline void clock_wave(GbApu* apu, GbApuWave* wave, bool is_agb)
     }
 }
 
-static inline void clock_noise(GbApuNoise* noise, unsigned bits)
+static inline unsigned wave_current_sample(const GbApuWave* wave)
+{
+    return (wave->position_counter & 0x1) ? wave->sample_buffer & 0xF : wave->sample_buffer >> 4;
+}
+
+// same as calling clock_wave() count times.
+static void wave_advance(GbApu* apu, GbApuWave* wave, unsigned count, bool is_agb)
+{
+    const unsigned position = wave->position_counter + count;
+
+    // swap banks if in single bank mode and the position wrapped an odd number of times.
+    const bool bank_mode = REG_NR30 & 0x20;
+    if (is_agb && bank_mode && ((position / 32) & 0x1))
+    {
+        REG_NR30 ^= 0x40;
+    }
+
+    wave->position_counter = position % 32;
+
+    // the buffer is fetched on even positions, if the new position is odd
+    // then the fetch happened the clock before, which was only this advance if count > 1.
+    if (!(wave->position_counter & 0x1) || count > 1)
+    {
+        const bool bank_select = REG_NR30 & 0x40;
+        const unsigned bank_offset = (is_agb && bank_select) ? 16 : 0;
+        wave->sample_buffer = REG_WAVE_TABLE[bank_offset + (wave->position_counter >> 1)];
+    }
+}
+
+static inline int apply_gain(int sample, int gain)
+{
+    return (sample * gain) >> GAIN_SCALE;
+}
+
+// fills out the left and right gain of a psg channel for the values of nr50 and nr51.
+// mono outputs the average of left and right, only the left delta is used.
+static inline void fold_mono_gain(const GbApu* apu, int gain[2])
+{
+    if (apu->mono)
+    {
+        gain[0] = gain[1] = (gain[0] + gain[1]) / 2;
+    }
+}
+
+static void psg_gain(const GbApu* apu, unsigned num, unsigned nr50, unsigned nr51, int out[2])
+{
+    const int psg_shift = apu_is_agb(apu) ? AGB_PSG_SHIFT_TABLE[REG_SOUNDCNT_H & 0x3] : 0;
+    const int shift = num == ChannelType_WAVE ? 0 : psg_shift; // wave ignores the agb psg volume.
+    const int gain = blip_wrap_volume_to_gain(apu->blip, apu->channel_volume[num]);
+    const int left_volume = 1 + ((nr50 >> 0) & 0x7);
+    const int right_volume = 1 + ((nr50 >> 4) & 0x7);
+    const bool left_enabled = nr51 & (1 << (num + 0));
+    const bool right_enabled = nr51 & (1 << (num + 4));
+
+    out[0] = (gain * left_enabled * left_volume) >> shift;
+    out[1] = (gain * right_enabled * right_volume) >> shift;
+    fold_mono_gain(apu, out);
+}
+
+// the output only depends on the 4-bit sample and registers that rarely change,
+// so the output for every sample is built once and reused until one changes.
+static void wave_update_amps(GbApu* apu, bool is_agb)
+{
+    const int invert = is_agb ? 0xF : 0x0; // inverted on agb.
+    const int wave_mult = WAVE_VOLUME_MULTIPLIER[(REG_NR32 >> 5) & (is_agb ? 0x7 : 0x3)];
+    const int* gain = apu->gain[ChannelType_WAVE];
+
+    for (int i = 0; i < 16; i++)
+    {
+        const int sample = (((i ^ invert) * 2 - 15) * wave_mult) >> 2; // [-15,+15]
+        apu->wave_amp[i][0] = apply_gain(sample, gain[0]);
+        apu->wave_amp[i][1] = apply_gain(sample, gain[1]);
+    }
+
+    apu->wave_amp_dirty = false;
+}
+
+// returns true if the waveform of the channel repeats faster than the ultrasonic threshold.
+static inline bool channel_is_ultrasonic(const GbApu* apu, unsigned num, unsigned freq, bool is_agb)
+{
+    if (num == ChannelType_SQUARE0 || num == ChannelType_SQUARE1)
+    {
+        return freq * 8 < apu->ultrasonic_period;
+    }
+    else if (num == ChannelType_WAVE)
+    {
+        const bool bank_mode = is_agb && (REG_NR30 & 0x20);
+        return freq * (bank_mode ? 64 : 32) < apu->ultrasonic_period;
+    }
+
+    // noise has no waveform to average.
+    return false;
+}
+
+// the average output of the channel over a whole waveform.
+static void channel_average(GbApu* apu, unsigned num, bool is_agb, int out[2])
+{
+    const int* gain = apu->gain[num];
+
+    if (num == ChannelType_SQUARE0 || num == ChannelType_SQUARE1)
+    {
+        const unsigned duty = apu->io[SQAURE_DUTY_ADDR[num]] >> 6;
+        const int sign = is_agb ? -1 : +1; // inverted on agb.
+        const int sum = (SQUARE_DUTY_HIGH_COUNT[duty] * 2 - 8) * apu->env[num].volume * sign;
+
+        out[0] = apply_gain(sum, gain[0]) / 8;
+        out[1] = apply_gain(sum, gain[1]) / 8;
+    }
+    else
+    {
+        if (apu->wave_amp_dirty)
+        {
+            wave_update_amps(apu, is_agb);
+        }
+
+        // single bank mode plays both banks.
+        const bool bank_mode = is_agb && (REG_NR30 & 0x20);
+        const bool bank_select = REG_NR30 & 0x40;
+        const unsigned bank_offset = (is_agb && bank_select && !bank_mode) ? 16 : 0;
+        const unsigned count = bank_mode ? 32 : 16;
+        int sum[2] = { 0, 0 };
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            const unsigned value = REG_WAVE_TABLE[bank_offset + i];
+            sum[0] += apu->wave_amp[value >> 4][0] + apu->wave_amp[value & 0xF][0];
+            sum[1] += apu->wave_amp[value >> 4][1] + apu->wave_amp[value & 0xF][1];
+        }
+
+        out[0] = sum[0] / (int)(count * 2);
+        out[1] = sum[1] / (int)(count * 2);
+    }
+}
+
+// clocks the lfsr count times at once, count is at most 14 (15-bit) or 6 (7-bit)
+// so that none of the bits shifted in are shifted down to bit0 again.
+// returns a mask where bit n is set if bit0 changed on the n+1 clock.
+static inline unsigned clock_noise(GbApuNoise* noise, unsigned count, bool narrow)
+{
+    const unsigned lfsr = noise->lfsr;
+    const unsigned mask = (1U << count) - 1;
+    // bit0 changes when bit1 != bit0, in which case the result shifted in is 0.
+    const unsigned changes = (lfsr ^ (lfsr >> 1)) & mask;
+    const unsigned results = ~changes & mask;
+
+    // results are shifted in at bit-14, and also at bit-6 in 7-bit mode.
+    unsigned new_lfsr = (lfsr >> count) | (results << (15 - count));
+    if (narrow)
+    {
+        new_lfsr &= ~(mask << (7 - count));
+        new_lfsr |= results << (7 - count);
+    }
+
+    noise->lfsr = new_lfsr;
+    return changes;
+}
+
+static inline unsigned noise_apply_jump(const uint16_t jump[16], unsigned lfsr)
+{
+    unsigned result = jump[15];
+    for (unsigned i = 0; i < 15; i++)
+    {
+        result ^= jump[i] & -((lfsr >> i) & 0x1);
+    }
+    return result;
+}
+
+// clocks the lfsr count times without generating any output.
+static void noise_jump(GbApuNoise* noise, unsigned count, bool narrow)
+{
+    const uint16_t (*jump)[16];
+    if (narrow)
+    {
+        if (count >= 8)
+        {
+            count = 8 + (count - 8) % 127;
+        }
+        jump = NOISE_JUMP_7BIT;
+    }
+    else
+    {
+        count %= 32767;
+        jump = NOISE_JUMP_15BIT;
+    }
+
+    unsigned lfsr = noise->lfsr;
+    for (unsigned n = 0; count; n++, count >>= 1)
+    {
+        if (count & 0x1)
+        {
+            lfsr = noise_apply_jump(jump[n], lfsr);
+        }
+    }
+    noise->lfsr = lfsr;
+}
+
+// same as the psg sync, but only advances the state without any output.
+static APU_FORCE_INLINE void channel_advance(GbApu* apu, unsigned num, unsigned clock_count, bool is_agb)
 {
-    // result = bit1 != bit0
-    const bool result = (((noise->lfsr >> 1) ^ noise->lfsr) ^ 1) & 0x1;
-    // now we shift the lfsr BEFORE setting the value!
-    noise->lfsr >>= 1;
-    // unset bit-14 or bit-6 AND bit-14
-    noise->lfsr &= ~bits;
-    // set bit-14 or bit-6 AND bit-14
-    noise->lfsr |= bits * result;
+    if (num == ChannelType_SQUARE0 || num == ChannelType_SQUARE1)
+    {
+        clock_square(&apu->square[num], clock_count);
+    }
+    else if (num == ChannelType_WAVE)
+    {
+        wave_advance(apu, &apu->wave, clock_count, is_agb);
+    }
+    else if (num == ChannelType_NOISE)
+    {
+        // clock shift of 14/15 means noise recieves no clocks!
+        const unsigned clock_shift = REG_NR43 >> 4;
+        if (apu->noise.lfsr != 0x7FFF && clock_shift < 14)
+        {
+            noise_jump(&apu->noise, clock_count, REG_NR43 & 0x8);
+        }
+    }
 }
 
-static void channel_sync_psg(GbApu* apu, unsigned num, unsigned time)
+static APU_FORCE_INLINE void channel_sync_psg_impl(GbApu* apu, unsigned num, unsigned time, enum GbApuType type, bool output)
 {
     GbApuChannel* c = &apu->channels[num];
 
@@ -573,115 +1185,128 @@ static void channel_sync_psg(GbApu* apu, unsigned num, unsigned time)
 
     if (!apu_is_enabled(apu) || !channel_is_enabled(apu, num))
     {
-        add_delta(apu, c, from, 0, 0);
-        add_delta(apu, c, from, 0, 1);
+        if (output)
+        {
+            add_delta(apu, c, from, 0, 0);
+        }
         return;
     }
 
-    const bool is_agb = apu_is_agb(apu);
-    const bool left_enabled = REG_NR51 & (1 << (num + 0));
-    const bool right_enabled = REG_NR51 & (1 << (num + 4));
-    const int left_volume = left_enabled * (1 + ((REG_NR50 >> 0) & 0x7));
-    const int right_volume = right_enabled * (1 + ((REG_NR50 >> 4) & 0x7));
-    const int psg_shift = is_agb ? AGB_PSG_SHIFT_TABLE[REG_SOUNDCNT_H & 0x3] : 0;
-
-    const unsigned freq = channel_get_frequency(apu, num);
-    const float volume = apu->channel_volume[num];
+    const bool is_agb = GB_APU_AGB && type == GbApuType_AGB;
+    const int* gain = apu->gain[num];
+    const unsigned freq = apu->period[num];
 
     // adjust frequency_timer and calculate how many times to clock channel.
     const int frequency_timer = (int)c->frequency_timer - (int)until;
     int clock_count = frequency_timer <= 0 ? (1 + -frequency_timer / freq) : (0);
     c->frequency_timer = frequency_timer + freq * clock_count;
 
+    // the resampler filters channels far above the output rate down to
+    // their average, so output that rather than every edge.
+    const bool ultrasonic = output && channel_is_ultrasonic(apu, num, freq, is_agb);
+    if (ultrasonic)
+    {
+        int average[2];
+        channel_average(apu, num, is_agb, average);
+        add_delta(apu, c, from, average[0], average[1]);
+    }
+
+    if (!output || ultrasonic)
+    {
+        if (clock_count)
+        {
+            if (num == ChannelType_WAVE)
+            {
+                apu->wave.just_accessed = c->frequency_timer == freq;
+            }
+            channel_advance(apu, num, clock_count, is_agb);
+        }
+        return;
+    }
+
     // generate a sample for the selected channel.
     if (num == ChannelType_SQUARE0 || num == ChannelType_SQUARE1)
     {
         GbApuSquare* square = &apu->square[num];
         const unsigned duty = apu->io[SQAURE_DUTY_ADDR[num]] >> 6;
-        bool duty_bit = SQUARE_DUTY_CYCLES[duty][square->duty_index];
-        int sign_flipflop = (duty_bit ^ is_agb) ? +1 : -1; // inverted on agb.
+        const bool duty_bit = square_duty_bit(duty, square->duty_index);
+        const int sign_flipflop = (duty_bit ^ is_agb) ? +1 : -1; // inverted on agb.
 
         const int envelope = apu->env[num].volume;
-        int left = blip_apply_volume_to_sample(apu->blip, envelope * left_volume * sign_flipflop >> psg_shift, volume);
-        int right = blip_apply_volume_to_sample(apu->blip, envelope * right_volume * sign_flipflop >> psg_shift, volume);
-        add_delta(apu, c, from, left, 0);
-        add_delta(apu, c, from, right, 1);
+        int left = apply_gain(envelope * sign_flipflop, gain[0]);
+        int right = apply_gain(envelope * sign_flipflop, gain[1]);
+        add_delta(apu, c, from, left, right);
 
         if (clock_count)
         {
             if (left || right)
             {
-                do {
-                    clock_square(square, 1);
-                    const bool new_duty_bit = SQUARE_DUTY_CYCLES[duty][square->duty_index];
-                    if (duty_bit != new_duty_bit)
+                // bit n is set if the output changes on the (n + 1)th clock from now,
+                // so only the edges are visited rather than every clock.
+                const unsigned edges = rotate_right8(SQUARE_DUTY_EDGES[duty], (square->duty_index + 1) % 8);
+
+                for (unsigned clocked = 0; clocked < (unsigned)clock_count; clocked += 8)
+                {
+                    const unsigned remaining = clock_count - clocked;
+                    unsigned pending = remaining < 8 ? edges & ((1U << remaining) - 1) : edges;
+
+                    while (pending)
                     {
-                        duty_bit = new_duty_bit;
+                        const unsigned n = apu_ctz(pending);
+                        pending &= pending - 1;
                         left = -left;
                         right = -right;
-                        add_delta(apu, c, from, left, 0);
-                        add_delta(apu, c, from, right, 1);
+                        add_delta(apu, c, from + (clocked + n) * freq, left, right);
                     }
-                    from += freq;
-                } while (--clock_count);
-            }
-            else
-            {
-                clock_square(square, clock_count);
+                }
             }
+
+            clock_square(square, clock_count);
         }
     }
     else if (num == ChannelType_WAVE)
     {
         GbApuWave* wave = &apu->wave;
-        const int invert = is_agb ? 0xF : 0x0; // inverted on agb.
         const int wave_mult = WAVE_VOLUME_MULTIPLIER[(REG_NR32 >> 5) & (is_agb ? 0x7 : 0x3)];
-        int sample = (wave->position_counter & 0x1) ? wave->sample_buffer & 0xF : wave->sample_buffer >> 4;
-        sample = (((sample ^ invert) * 2 - 15) * wave_mult) >> 2; // [-15,+15]
 
-        int left = blip_apply_volume_to_sample(apu->blip, sample * left_volume, volume);
-        int right = blip_apply_volume_to_sample(apu->blip, sample * right_volume, volume);
-        add_delta(apu, c, from, left, 0);
-        add_delta(apu, c, from, right, 1);
+        if (apu->wave_amp_dirty)
+        {
+            wave_update_amps(apu, is_agb);
+        }
+
+        unsigned sample = wave_current_sample(wave);
+        add_delta(apu, c, from, apu->wave_amp[sample][0], apu->wave_amp[sample][1]);
 
         if (clock_count)
         {
             // if ticked, and timer==freq, that means it was accessed on this very cycle.
             wave->just_accessed = clock_count && c->frequency_timer == freq;
 
-            if ((left_volume || right_volume) && wave_mult)
+            if ((gain[0] || gain[1]) && wave_mult)
             {
                 do {
                     clock_wave(apu, wave, is_agb);
-                    sample = (wave->position_counter & 0x1) ? wave->sample_buffer & 0xF : wave->sample_buffer >> 4;
-                    sample = (((sample ^ invert) * 2 - 15) * wave_mult) >> 2; // [-15,+15]
-
-                    int left = blip_apply_volume_to_sample(apu->blip, sample * left_volume, volume);
-                    int right = blip_apply_volume_to_sample(apu->blip, sample * left_volume, volume);
-                    add_delta(apu, c, from, left, 0);
-                    add_delta(apu, c, from, right, 1);
+                    sample = wave_current_sample(wave);
+                    add_delta(apu, c, from, apu->wave_amp[sample][0], apu->wave_amp[sample][1]);
                     from += freq;
                 } while (--clock_count);
             }
             else
             {
-                do {
-                    clock_wave(apu, wave, is_agb);
-                } while (--clock_count);
+                wave_advance(apu, wave, clock_count, is_agb);
             }
         }
     }
     else if (num == ChannelType_NOISE)
     {
         GbApuNoise* noise = &apu->noise;
-        bool bit0 = noise->lfsr & 0x1;
+        const bool bit0 = noise->lfsr & 0x1;
         const int sign_flipflop = (bit0 ^ is_agb) ? +1 : -1; // inverted on agb.
 
         const int envelope = apu->env[num].volume;
-        int left = blip_apply_volume_to_sample(apu->blip, envelope * left_volume * sign_flipflop >> psg_shift, volume);
-        int right = blip_apply_volume_to_sample(apu->blip, envelope * right_volume * sign_flipflop >> psg_shift, volume);
-        add_delta_fast(apu, c, from, left, 0);
-        add_delta_fast(apu, c, from, right, 1);
+        int left = apply_gain(envelope * sign_flipflop, gain[0]);
+        int right = apply_gain(envelope * sign_flipflop, gain[1]);
+        add_delta_fast(apu, c, from, left, right);
 
         if (clock_count)
         {
@@ -689,35 +1314,98 @@ static void channel_sync_psg(GbApu* apu, unsigned num, unsigned time)
             const unsigned clock_shift = REG_NR43 >> 4;
             if (noise->lfsr != 0x7FFF && clock_shift < 14)
             {
-                const unsigned bits = (REG_NR43 & 0x8) ? 0x4040 : 0x4000;
+                const bool narrow = REG_NR43 & 0x8;
 
                 if (left || right)
                 {
-                    do {
-                        clock_noise(noise, bits);
-                        const bool new_bit0 = noise->lfsr & 0x1;
-                        if (bit0 != new_bit0)
+                    // step in chunks, emitting a delta for each bit0 change.
+                    const unsigned chunk = narrow ? 6 : 14;
+                    unsigned clocked = 0;
+                    while (clocked < (unsigned)clock_count)
+                    {
+                        const unsigned count = apu_min(chunk, clock_count - clocked);
+                        unsigned changes = clock_noise(noise, count, narrow);
+                        while (changes)
                         {
-                            bit0 = new_bit0;
+                            const unsigned n = apu_ctz(changes);
+                            changes &= changes - 1;
                             left = -left;
                             right = -right;
-                            add_delta_fast(apu, c, from, left, 0);
-                            add_delta_fast(apu, c, from, right, 1);
+                            add_delta_fast(apu, c, from + (clocked + n) * freq, left, right);
                         }
-                        from += freq;
-                    } while (--clock_count);
+                        clocked += count;
+                    }
                 }
                 else
                 {
-                    do {
-                        clock_noise(noise, bits);
-                    } while (--clock_count);
+                    noise_jump(noise, clock_count, narrow);
                 }
             }
         }
     }
 }
 
+// the psg only differs between gb and agb, so it's built once for each
+// with the type known at compile time, apu_reset() selects which to use.
+// the no_output versions are used when audio output is disabled.
+static void channel_sync_psg_gb(GbApu* apu, unsigned num, unsigned time)
+{
+    channel_sync_psg_impl(apu, num, time, GbApuType_CGB, true);
+}
+
+static void channel_sync_psg_gb_no_output(GbApu* apu, unsigned num, unsigned time)
+{
+    channel_sync_psg_impl(apu, num, time, GbApuType_CGB, false);
+}
+
+#if GB_APU_AGB
+static void channel_sync_psg_agb(GbApu* apu, unsigned num, unsigned time)
+{
+    channel_sync_psg_impl(apu, num, time, GbApuType_AGB, true);
+}
+
+static void channel_sync_psg_agb_no_output(GbApu* apu, unsigned num, unsigned time)
+{
+    channel_sync_psg_impl(apu, num, time, GbApuType_AGB, false);
+}
+#endif
+
+// the output of a channel up until a nr50 / nr51 write uses the old values,
+// so they are swapped in to sync up to the write, then the new gain is restored.
+static void channel_apply_pending_gain(GbApu* apu, unsigned num)
+{
+    GbApuPendingGain* pending = &apu->pending_gain[num];
+    const int gain[2] = { apu->gain[num][0], apu->gain[num][1] };
+
+    // only the wave channel's own gain is cached in wave_amp, which keeps
+    // channels independent for channel_sync_psg_all_parallel().
+    const bool is_wave = num == ChannelType_WAVE;
+
+    pending->pending = false;
+    psg_gain(apu, num, pending->nr50, pending->nr51, apu->gain[num]);
+    if (is_wave)
+    {
+        apu->wave_amp_dirty = true;
+    }
+    apu->sync_psg(apu, num, pending->time);
+
+    apu->gain[num][0] = gain[0];
+    apu->gain[num][1] = gain[1];
+    if (is_wave)
+    {
+        apu->wave_amp_dirty = true;
+    }
+}
+
+static inline void channel_sync_psg(GbApu* apu, unsigned num, unsigned time)
+{
+    if (apu->pending_gain[num].pending)
+    {
+        channel_apply_pending_gain(apu, num);
+    }
+    apu->sync_psg(apu, num, time);
+}
+
 static void channel_sync_fifo(GbApu* apu, unsigned num, unsigned time)
 {
     GbApuChannel* c = &apu->channels[num];
@@ -745,25 +1433,22 @@ static void channel_sync_fifo(GbApu* apu, unsigned num, unsigned time)
         return;
     }
 
+    if (apu->audio_output_disabled)
+    {
+        return;
+    }
+
     if (!apu_is_enabled(apu))
     {
         add_delta(apu, c, from, 0, 0);
-        add_delta(apu, c, from, 0, 1);
         return;
     }
 
-    const unsigned reg = REG_SOUNDCNT_H;
-    const bool volume_code = num == ChannelType_FIFOA ? (reg & 0x4) : (reg & 0x8);
-    const bool enable_right = num == ChannelType_FIFOA ? (reg & 0x100) : (reg & 0x1000);
-    const bool enable_left = num == ChannelType_FIFOA ? (reg & 0x200) : (reg & 0x2000);
-
     const GbApuFifo* fifo = &apu->fifo[num - ChannelType_FIFOA];
-    const int sample = fifo->current_sample * (volume_code ? 4 : 2);
-    const int left = blip_apply_volume_to_sample(apu->blip, sample * enable_left, apu->channel_volume[num]);
-    const int right = blip_apply_volume_to_sample(apu->blip, sample * enable_right, apu->channel_volume[num]);
+    const int left = apply_gain(fifo->current_sample, apu->gain[num][0]);
+    const int right = apply_gain(fifo->current_sample, apu->gain[num][1]);
 
-    add_delta(apu, c, from, left, 0);
-    add_delta(apu, c, from, right, 1);
+    add_delta(apu, c, from, left, right);
 }
 
 static void channel_sync_psg_all(GbApu* apu, unsigned time)
@@ -774,6 +1459,60 @@ static void channel_sync_psg_all(GbApu* apu, unsigned time)
     channel_sync_psg(apu, ChannelType_NOISE, time);
 }
 
+typedef struct GbApuParallelSync
+{
+    GbApu* apu;
+    unsigned time;
+} GbApuParallelSync;
+
+// catches up the channel, then adds its logged deltas to its own buffer, which
+// is mixed in apu_end_frame().
+static void parallel_sync_task(void* data, unsigned num)
+{
+    const GbApuParallelSync* sync = (const GbApuParallelSync*)data;
+    GbApu* apu = sync->apu;
+
+    channel_sync_psg(apu, num, sync->time);
+    event_log_resolve_to(apu, num, apu->parallel_blip[num]);
+    if (num == ChannelType_NOISE)
+    {
+        event_log_resolve_to(apu, EVENT_LOG_FAST, apu->parallel_blip[num]);
+    }
+}
+
+// syncs and resamples each psg channel on its own task, each only touches its
+// own state, event log, stem and buffer.
+// returns false if it can't, in which case nothing is synced.
+static bool channel_sync_psg_all_parallel(GbApu* apu, unsigned time)
+{
+    if (!apu->parallel_for || !apu->event_log || apu->audio_output_disabled)
+    {
+        return false;
+    }
+
+    // a full log is resolved early, which isn't thread safe, so make room for
+    // a delta on every clock, plus a few for the first sample and nr50/nr51.
+    for (unsigned num = ChannelType_SQUARE0; num <= ChannelType_NOISE; num++)
+    {
+        const unsigned count = (time - apu->channels[num].timestamp) / apu->period[num] + 8;
+
+        if (!event_log_reserve(&apu->event_log[num], count))
+        {
+            return false;
+        }
+
+        if (num == ChannelType_NOISE && !event_log_reserve(&apu->event_log[EVENT_LOG_FAST], count))
+        {
+            return false;
+        }
+    }
+
+    GbApuParallelSync sync = { apu, time };
+    apu->parallel_for(apu->parallel_user, parallel_sync_task, &sync, ChannelType_NOISE + 1);
+
+    return true;
+}
+
 static void channel_sync_fifo_all(GbApu* apu, unsigned time)
 {
     channel_sync_fifo(apu, ChannelType_FIFOA, time);
@@ -825,6 +1564,7 @@ static void sweep_do_freq_calc(GbApu* apu, bool update_value)
         apu->sweep.freq_shadow_register = new_freq;
         REG_NR13 = new_freq & 0xFF;
         REG_NR14 = (REG_NR14 & ~0x7) | new_freq >> 8;
+        channel_update_period(apu, ChannelType_SQUARE0);
     }
 }
 
@@ -1024,7 +1764,7 @@ static void env_write(GbApu* apu, unsigned num, unsigned new_value, unsigned old
 static void trigger(GbApu* apu, unsigned num, unsigned time)
 {
     GbApuChannel* c = &apu->channels[num];
-    const unsigned new_freq = channel_get_frequency(apu, num);
+    const unsigned new_freq = apu->period[num];
     const bool was_enabled = channel_is_enabled(apu, num);
 
     channel_enable(apu, num);
@@ -1158,11 +1898,186 @@ static void frame_sequencer_clock_env(GbApu* apu, unsigned time)
     env_clock(apu, ChannelType_NOISE, time);
 }
 
+static void frame_sequencer_clock(GbApu* apu, unsigned time)
+{
+    if (!apu_is_enabled(apu))
+    {
+        return;
+    }
+
+    switch (apu->frame_sequencer.index)
+    {
+        case 0: // len
+        case 4:
+            frame_sequencer_clock_len(apu, time);
+            break;
+
+        case 2: // len, sweep
+        case 6:
+            frame_sequencer_clock_len(apu, time);
+            frame_sequencer_clock_sweep(apu, time);
+            break;
+
+        case 7: // vol
+            frame_sequencer_clock_env(apu, time);
+            break;
+    }
+
+    apu->frame_sequencer.index = (apu->frame_sequencer.index + 1) % 8;
+}
+
+// returns how many of the next count steps are a step of the type, which happens
+// every interval steps when the index % interval == remainder.
+static unsigned frame_sequencer_count_steps(unsigned index, unsigned count, unsigned interval, unsigned remainder)
+{
+    const unsigned first = (remainder + interval - index % interval) % interval;
+    return first < count ? (count - 1 - first) / interval + 1 : 0;
+}
+
+// returns how many steps until the nth step of the type, see above.
+static unsigned frame_sequencer_steps_until(unsigned index, unsigned n, unsigned interval, unsigned remainder)
+{
+    const unsigned first = (remainder + interval - index % interval) % interval;
+    return first + (n - 1) * interval;
+}
+
+static const uint8_t FRAME_SEQUENCER_ENV_CHANNELS[] = { ChannelType_SQUARE0, ChannelType_SQUARE1, ChannelType_NOISE };
+
+// len, env and sweep are counters that only affect a channel once they reach 0.
+// returns how many steps until the first step that a counter reaches 0, or max
+// if none do within max steps.
+static unsigned frame_sequencer_steps_until_event(const GbApu* apu, unsigned max)
+{
+    const unsigned index = apu->frame_sequencer.index;
+    unsigned count = max;
+
+    for (unsigned num = ChannelType_SQUARE0; num <= ChannelType_NOISE; num++)
+    {
+        if (len_is_enabled(apu, num) && apu->len[num].counter > 0)
+        {
+            count = apu_min(count, frame_sequencer_steps_until(index, apu->len[num].counter, 2, 0));
+        }
+    }
+
+    for (unsigned i = 0; i < apu_array_size(FRAME_SEQUENCER_ENV_CHANNELS); i++)
+    {
+        const GbApuEnvelope* env = &apu->env[FRAME_SEQUENCER_ENV_CHANNELS[i]];
+        if (channel_is_enabled(apu, FRAME_SEQUENCER_ENV_CHANNELS[i]) && !env->disable)
+        {
+            count = apu_min(count, frame_sequencer_steps_until(index, ((env->timer - 1) & 0x7) + 1, 8, 7));
+        }
+    }
+
+    if (channel_is_enabled(apu, ChannelType_SQUARE0) && apu->sweep.enabled)
+    {
+        count = apu_min(count, frame_sequencer_steps_until(index, ((apu->sweep.timer - 1) & 0x7) + 1, 4, 2));
+    }
+
+    return count;
+}
+
+// steps up until a counter reaches 0 just decrement them, so are applied at once.
+// the step where a counter reaches 0 is clocked as normal.
+static void frame_sequencer_advance(GbApu* apu, unsigned steps, unsigned time_per_step, unsigned time)
+{
+    // the index isn't advanced whilst disabled.
+    while (steps && apu_is_enabled(apu))
+    {
+        const unsigned index = apu->frame_sequencer.index;
+        const bool sweep_active = channel_is_enabled(apu, ChannelType_SQUARE0) && apu->sweep.enabled;
+        const unsigned count = frame_sequencer_steps_until_event(apu, steps);
+
+        // apply the steps before it.
+        if (count)
+        {
+            const unsigned len_steps = frame_sequencer_count_steps(index, count, 2, 0);
+            const unsigned env_steps = frame_sequencer_count_steps(index, count, 8, 7);
+            const unsigned sweep_steps = frame_sequencer_count_steps(index, count, 4, 2);
+
+            for (unsigned num = ChannelType_SQUARE0; num <= ChannelType_NOISE; num++)
+            {
+                if (len_is_enabled(apu, num) && apu->len[num].counter > 0)
+                {
+                    apu->len[num].counter -= len_steps;
+                }
+            }
+
+            for (unsigned i = 0; i < apu_array_size(FRAME_SEQUENCER_ENV_CHANNELS); i++)
+            {
+                GbApuEnvelope* env = &apu->env[FRAME_SEQUENCER_ENV_CHANNELS[i]];
+                if (env_steps && channel_is_enabled(apu, FRAME_SEQUENCER_ENV_CHANNELS[i]) && !env->disable)
+                {
+                    env->timer = (env->timer - env_steps) & 0x7;
+                }
+            }
+
+            if (sweep_steps && sweep_active)
+            {
+                apu->sweep.timer = (apu->sweep.timer - sweep_steps) & 0x7;
+            }
+
+            apu->frame_sequencer.index = (index + count) % 8;
+            steps -= count;
+            time += count * time_per_step;
+        }
+
+        if (steps)
+        {
+            frame_sequencer_clock(apu, time);
+            steps--;
+            time += time_per_step;
+        }
+    }
+}
+
+// when clocked internally, runs every step up to and including time.
+static void frame_sequencer_catch_up(GbApu* apu, unsigned time)
+{
+    GbApuFrameSequencerTimer* timer = &apu->frame_sequencer_timer;
+
+    if (timer->enabled && (int)(time - timer->next_time) >= 0)
+    {
+        const unsigned steps = (time - timer->next_time) / timer->period + 1;
+        frame_sequencer_advance(apu, steps, timer->period, timer->next_time);
+        timer->next_time += steps * timer->period;
+    }
+}
+
+#if GB_APU_AGB
 static unsigned fifo_get_size(const GbApuFifo* fifo)
 {
     return (fifo->w_index - fifo->r_index) % FIFO_CAPACITY;
 }
+#endif // GB_APU_AGB
+
+// folds the master, channel, nr50/nr51 and agb volumes into a single
+// fixed-point gain per channel, so that the output is apply_gain(sample, gain).
+// this must be called whenever any of them change.
+static void update_gains(GbApu* apu)
+{
+    for (unsigned num = ChannelType_SQUARE0; num <= ChannelType_NOISE; num++)
+    {
+        psg_gain(apu, num, REG_NR50, REG_NR51, apu->gain[num]);
+    }
+
+    for (unsigned num = ChannelType_FIFOA; num <= ChannelType_FIFOB; num++)
+    {
+        const int gain = blip_wrap_volume_to_gain(apu->blip, apu->channel_volume[num]);
+        const unsigned reg = REG_SOUNDCNT_H;
+        const bool volume_code = num == ChannelType_FIFOA ? (reg & 0x4) : (reg & 0x8);
+        const bool enable_right = num == ChannelType_FIFOA ? (reg & 0x100) : (reg & 0x1000);
+        const bool enable_left = num == ChannelType_FIFOA ? (reg & 0x200) : (reg & 0x2000);
+        const int fifo_volume = volume_code ? 4 : 2;
+
+        apu->gain[num][0] = gain * fifo_volume * enable_left;
+        apu->gain[num][1] = gain * fifo_volume * enable_right;
+        fold_mono_gain(apu, apu->gain[num]);
+    }
+
+    apu->wave_amp_dirty = true;
+}
 
+#if GB_APU_AGB
 static void fifo_reset(GbApuFifo* fifo)
 {
     fifo->r_index = fifo->w_index = 0;
@@ -1181,6 +2096,7 @@ static void fifo_write(GbApu* apu, unsigned addr, unsigned value, unsigned mask)
     fifo->ring_buf[fifo->w_index] = result;
     fifo->w_index = (fifo->w_index + 1) % FIFO_CAPACITY; // advance write pointer
 }
+#endif // GB_APU_AGB
 
 #if defined(GB_APU_HAS_MATH_H) && GB_APU_HAS_MATH_H
 static inline int high_pass(int charge_factor, int in, int* capacitor)
@@ -1190,109 +2106,47 @@ static inline int high_pass(int charge_factor, int in, int* capacitor)
     *capacitor = (in - out * charge_factor);
     return apu_clamp(out, INT16_MIN, INT16_MAX);
 }
-#endif
 
-/* ------------------PUBLIC API------------------ */
-GbApu* apu_init(double clock_rate, double sample_rate)
+// same as high_pass(), but the output isn't clamped. the capacitor is charged
+// as if the input were clamped, so that it matches apu_read_samples(), and
+// anything past 16-bits passes through as is.
+static inline int high_pass_unclamped(int charge_factor, int in, int* capacitor)
 {
-    GbApu* apu = calloc(1, sizeof(*apu));
-    if (!apu)
-    {
-        goto fail;
-    }
-
-    for (unsigned i = 0; i < apu_array_size(apu->channel_volume); i++)
-    {
-        apu->channel_volume[i] = 1.0;
-    }
-
-    if (!(apu->blip = blip_wrap_new(sample_rate))) {
-        goto fail;
-    }
-
-    if (blip_wrap_set_rates(apu->blip, clock_rate, sample_rate)) {
-        goto fail;
-    }
-
-    apu_set_master_volume(apu, 0.25);
-    apu_set_highpass_filter(apu, GbApuFilter_NONE, clock_rate, sample_rate);
-
-    return apu;
-
-fail:
-    apu_quit(apu);
-    return NULL;
+    const int clamped = apu_clamp(in, INT16_MIN, INT16_MAX);
+    const int shifted = clamped << CAPACITOR_SCALE;
+    const int out = (shifted - *capacitor) >> CAPACITOR_SCALE;
+    *capacitor = (shifted - out * charge_factor);
+    return out + (in - clamped);
 }
+#endif
 
-void apu_quit(GbApu* apu)
+/* ------------------PUBLIC API------------------ */
+// syncs the psg channels in mask, unless already synced at this time in a batch.
+static APU_FORCE_INLINE void write_io_sync(GbApu* apu, unsigned mask, unsigned time, unsigned* synced)
 {
-    if (apu)
+    if (synced)
     {
-        if (apu->blip)
-        {
-            blip_wrap_delete(apu->blip);
-            apu->blip = NULL;
-        }
-        free(apu);
+        mask &= ~*synced;
+        *synced |= mask;
     }
-}
-
-void apu_reset(GbApu* apu, enum GbApuType type)
-{
-    apu->type = type;
-    apu_clear_samples(apu);
-    memset(&apu->channels, 0, sizeof(apu->channels));
-    memset(&apu->sweep, 0, sizeof(apu->sweep));
-    memset(&apu->len, 0, sizeof(apu->len));
-    memset(&apu->env, 0, sizeof(apu->env));
-    memset(&apu->square, 0, sizeof(apu->square));
-    memset(&apu->wave, 0, sizeof(apu->wave));
-    memset(&apu->noise, 0, sizeof(apu->noise));
-    memset(&apu->fifo, 0, sizeof(apu->fifo));
-    memset(&apu->frame_sequencer, 0, sizeof(apu->frame_sequencer));
-    apu->agb_soundcnt = 0;
-    apu->agb_soundbias = 0;
-    memset(apu->io + 0x10, 0, 0x17);
-    memcpy(REG_WAVE_TABLE, WAVE_RAM_INITIAL[type], sizeof(WAVE_RAM_INITIAL[type]));
-    memcpy(REG_WAVE_TABLE + sizeof(WAVE_RAM_INITIAL[type]), WAVE_RAM_INITIAL[type], sizeof(WAVE_RAM_INITIAL[type]));
-}
-
-unsigned apu_read_io(GbApu* apu, unsigned addr, unsigned time)
-{
-    assert((addr & 0xFF) >= 0x10 && (addr & 0xFF) <= 0x3F);
-    addr &= 0x3F;
 
-    if (addr >= 0x30 && addr <= 0x3F)
+    for (unsigned num = 0; num < 4; num++)
     {
-        if (apu_is_agb(apu))
-        {
-            // writes happen to the opposite bank.
-            const bool bank_select = REG_NR30 & 0x40;
-            const unsigned offset = (bank_select ^ 1) ? 16 : 0;
-            return apu->io[addr + offset];
-        }
-        else
+        if (mask & (1 << num))
         {
-            if (channel_is_enabled(apu, ChannelType_WAVE))
-            {
-                channel_sync_psg(apu, ChannelType_WAVE, time);
-                if (apu_is_cgb(apu) || apu->wave.just_accessed)
-                {
-                    return REG_WAVE_TABLE[apu->wave.position_counter >> 1];
-                }
-                else
-                {
-                    return 0xFF; // writes to dmg are ignored if wave wasn't just accessed.
-                }
-            }
+            channel_sync_psg(apu, num, time);
         }
     }
-
-    return apu->io[addr] | IO_READ_VALUE[apu->type][addr];
 }
 
-void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
+// synced is the mask of channels already synced to time in apu_write_io_batch(),
+// NULL otherwise.
+static APU_FORCE_INLINE void write_io_impl(GbApu* apu, unsigned addr, unsigned value, unsigned time, enum GbApuType type, unsigned* synced)
 {
+    const bool is_dmg = type == GbApuType_DMG;
+    const bool is_cgb = type != GbApuType_DMG; // same as apu_is_cgb(), includes agb.
+    const bool is_agb = GB_APU_AGB && type == GbApuType_AGB;
+
     assert((addr & 0xFF) >= 0x10 && (addr & 0xFF) <= 0x3F);
     addr &= 0x3F;
 
@@ -1302,7 +2156,7 @@ void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
         // check if it's now disabled
         if (apu_is_enabled(apu) && !(value & 0x80))
         {
-            channel_sync_psg_all(apu, time);
+            write_io_sync(apu, 0xF, time, synced);
 
             // len counters are unaffected on the dmg
             const unsigned nr11 = REG_NR11 & 0x3F;
@@ -1319,8 +2173,10 @@ void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
             memset(&apu->fifo, 0, sizeof(apu->fifo));
             memset(&apu->frame_sequencer, 0, sizeof(apu->frame_sequencer));
             memset(apu->io + 0x10, 0, 0x17);
+            update_gains(apu);
+            channel_update_period_all(apu);
 
-            if (apu_is_dmg(apu))
+            if (is_dmg)
             {
                 REG_NR11 = nr11;
                 REG_NR21 = nr21;
@@ -1342,7 +2198,7 @@ void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
     // wave ram is always accessable
     else if (addr >= 0x30 && addr <= 0x3F) // wave ram
     {
-        if (apu_is_agb(apu))
+        if (is_agb)
         {
             // writes happen to the opposite bank.
             const bool bank_select = REG_NR30 & 0x40;
@@ -1354,8 +2210,8 @@ void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
             // if enabled, writes are ignored on dmg, allowed on cgb.
             if (channel_is_enabled(apu, ChannelType_WAVE))
             {
-                channel_sync_psg(apu, ChannelType_WAVE, time);
-                if (apu_is_cgb(apu) || apu->wave.just_accessed)
+                write_io_sync(apu, 1 << ChannelType_WAVE, time, synced);
+                if (is_cgb || apu->wave.just_accessed)
                 {
                     REG_WAVE_TABLE[apu->wave.position_counter >> 1] = value;
                 }
@@ -1370,7 +2226,7 @@ void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
     else if (!apu_is_enabled(apu))
     {
         // len counters are writeable even if apu is off
-        if (apu_is_dmg(apu) && (addr == 0x11 || addr == 0x16 || addr == 0x1B || addr == 0x20))
+        if (is_dmg && (addr == 0x11 || addr == 0x16 || addr == 0x1B || addr == 0x20))
         {
             const unsigned num = IO_CHANNEL_NUM[addr] & 0x3;
             const unsigned old_value = apu->io[addr];
@@ -1383,8 +2239,45 @@ void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
     }
     else if (addr == 0x24 || addr == 0x25) // nr50 | nr51
     {
-        channel_sync_psg_all(apu, time);
+        // rather than syncing every channel, enabled channels keep the old values
+        // until they next sync. disabled channels that still hold a level are
+        // synced now, as that's when their step to 0 is output, silent ones
+        // aren't affected.
+        for (unsigned num = ChannelType_SQUARE0; num <= ChannelType_NOISE; num++)
+        {
+            GbApuPendingGain* pending = &apu->pending_gain[num];
+
+            if (pending->pending)
+            {
+                // only one write can be pending, so apply the older one.
+                if (pending->time != time)
+                {
+                    write_io_sync(apu, 1 << num, time, synced);
+                }
+            }
+            // agb wave swaps banks in nr30 as it's clocked, which is visible to reads.
+            else if (is_agb && num == ChannelType_WAVE)
+            {
+                write_io_sync(apu, 1 << num, time, synced);
+            }
+            else if (!channel_is_enabled(apu, num))
+            {
+                if (apu->channels[num].amp[0] || apu->channels[num].amp[1])
+                {
+                    write_io_sync(apu, 1 << num, time, synced);
+                }
+            }
+            else if (apu->channels[num].timestamp != time)
+            {
+                pending->time = time;
+                pending->nr50 = REG_NR50;
+                pending->nr51 = REG_NR51;
+                pending->pending = true;
+            }
+        }
+
         apu->io[addr] = value;
+        update_gains(apu);
     }
     else
     {
@@ -1392,11 +2285,20 @@ void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
         const unsigned nrxx = IO_CHANNEL_NUM[addr] & ~0x3;
         if (nrxx)
         {
-            channel_sync_psg(apu, num, time);
+            write_io_sync(apu, 1 << num, time, synced);
 
             const unsigned old_value = apu->io[addr];
             apu->io[addr] = value;
 
+            if (nrxx == NRx3 || nrxx == NRx4)
+            {
+                channel_update_period(apu, num);
+            }
+            else if (addr == 0x1C) // nr32
+            {
+                apu->wave_amp_dirty = true;
+            }
+
             switch (nrxx)
             {
                 case NRx0: on_nrx0_write(apu, num, time, value, old_value); break;
@@ -1409,45 +2311,346 @@ void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
     }
 }
 
-void apu_frame_sequencer_clock(GbApu* apu, unsigned time)
+static void write_io_dmg(GbApu* apu, unsigned addr, unsigned value, unsigned time)
 {
-    if (!apu_is_enabled(apu))
+    write_io_impl(apu, addr, value, time, GbApuType_DMG, NULL);
+}
+
+static void write_io_dmg_batch(GbApu* apu, unsigned addr, unsigned value, unsigned time, unsigned* synced)
+{
+    write_io_impl(apu, addr, value, time, GbApuType_DMG, synced);
+}
+
+static void write_io_cgb(GbApu* apu, unsigned addr, unsigned value, unsigned time)
+{
+    write_io_impl(apu, addr, value, time, GbApuType_CGB, NULL);
+}
+
+static void write_io_cgb_batch(GbApu* apu, unsigned addr, unsigned value, unsigned time, unsigned* synced)
+{
+    write_io_impl(apu, addr, value, time, GbApuType_CGB, synced);
+}
+
+#if GB_APU_AGB
+static void write_io_agb(GbApu* apu, unsigned addr, unsigned value, unsigned time)
+{
+    write_io_impl(apu, addr, value, time, GbApuType_AGB, NULL);
+}
+
+static void write_io_agb_batch(GbApu* apu, unsigned addr, unsigned value, unsigned time, unsigned* synced)
+{
+    write_io_impl(apu, addr, value, time, GbApuType_AGB, synced);
+}
+#endif
+
+// applies the writes at time in order, syncing each channel at most once.
+static void write_io_batch_at(GbApu* apu, const GbApuWrite* writes, unsigned count, unsigned time)
+{
+    unsigned synced = 0;
+
+    frame_sequencer_catch_up(apu, time);
+
+    for (unsigned i = 0; i < count; i++)
     {
-        return;
+        if (writes[i].time == time)
+        {
+            apu->write_io_batch(apu, writes[i].addr, writes[i].value, time, &synced);
+        }
     }
+}
 
-    switch (apu->frame_sequencer.index)
+static void apu_set_type(GbApu* apu, enum GbApuType type)
+{
+    assert((GB_APU_AGB || type != GbApuType_AGB) && "built without agb support");
+    apu->type = type;
+
+    const bool output = !apu->audio_output_disabled;
+
+    switch (type)
     {
-        case 0: // len
-        case 4:
-            frame_sequencer_clock_len(apu, time);
+        case GbApuType_DMG:
+            apu->sync_psg = output ? channel_sync_psg_gb : channel_sync_psg_gb_no_output;
+            apu->write_io = write_io_dmg;
+            apu->write_io_batch = write_io_dmg_batch;
             break;
 
-        case 2: // len, sweep
-        case 6:
-            frame_sequencer_clock_len(apu, time);
-            frame_sequencer_clock_sweep(apu, time);
+        case GbApuType_CGB:
+            apu->sync_psg = output ? channel_sync_psg_gb : channel_sync_psg_gb_no_output;
+            apu->write_io = write_io_cgb;
+            apu->write_io_batch = write_io_cgb_batch;
             break;
 
-        case 7: // vol
-            frame_sequencer_clock_env(apu, time);
+        case GbApuType_AGB:
+#if GB_APU_AGB
+            apu->sync_psg = output ? channel_sync_psg_agb : channel_sync_psg_agb_no_output;
+            apu->write_io = write_io_agb;
+            apu->write_io_batch = write_io_agb_batch;
+#else
+            apu->sync_psg = output ? channel_sync_psg_gb : channel_sync_psg_gb_no_output;
+            apu->write_io = write_io_cgb;
+            apu->write_io_batch = write_io_cgb_batch;
+#endif
             break;
     }
+}
 
-    apu->frame_sequencer.index = (apu->frame_sequencer.index + 1) % 8;
+static GbApu* apu_init_channels(double clock_rate, double sample_rate, bool mono)
+{
+    GbApu* apu = calloc(1, sizeof(*apu));
+    if (!apu)
+    {
+        goto fail;
+    }
+
+    apu->mono = mono;
+
+    for (unsigned i = 0; i < apu_array_size(apu->channel_volume); i++)
+    {
+        apu->channel_volume[i] = 1.0;
+    }
+
+    apu_set_type(apu, GbApuType_DMG);
+
+    if (!(apu->blip = mono ? blip_wrap_new_mono(sample_rate) : blip_wrap_new(sample_rate))) {
+        goto fail;
+    }
+
+    if (blip_wrap_set_rates(apu->blip, clock_rate, sample_rate)) {
+        goto fail;
+    }
+
+    apu_set_master_volume(apu, 0.25);
+    apu_set_highpass_filter(apu, GbApuFilter_NONE, clock_rate, sample_rate);
+    channel_update_period_all(apu);
+
+    return apu;
+
+fail:
+    apu_quit(apu);
+    return NULL;
+}
+
+GbApu* apu_init(double clock_rate, double sample_rate)
+{
+    return apu_init_channels(clock_rate, sample_rate, false);
+}
+
+GbApu* apu_init_mono(double clock_rate, double sample_rate)
+{
+    return apu_init_channels(clock_rate, sample_rate, true);
+}
+
+void apu_quit(GbApu* apu)
+{
+    if (apu)
+    {
+        if (apu->blip)
+        {
+            blip_wrap_delete(apu->blip);
+            apu->blip = NULL;
+        }
+        apu_snapshot_init(apu, 0);
+        apu_set_stem_output(apu, 0, 0.0, 0.0);
+        apu_set_parallel_for(apu, NULL, NULL, 0.0, 0.0);
+        free(apu->peek.samples);
+#if GB_APU_OUTPUT_RING
+        apu_output_ring_init(apu, 0);
+#endif
+        event_log_free(apu);
+        free(apu);
+    }
+}
+
+void apu_reset(GbApu* apu, enum GbApuType type)
+{
+    apu_set_type(apu, type);
+    apu_clear_samples(apu);
+    memset(&apu->channels, 0, sizeof(apu->channels));
+    memset(&apu->sweep, 0, sizeof(apu->sweep));
+    memset(&apu->len, 0, sizeof(apu->len));
+    memset(&apu->env, 0, sizeof(apu->env));
+    memset(&apu->square, 0, sizeof(apu->square));
+    memset(&apu->wave, 0, sizeof(apu->wave));
+    memset(&apu->noise, 0, sizeof(apu->noise));
+    memset(&apu->fifo, 0, sizeof(apu->fifo));
+    memset(&apu->frame_sequencer, 0, sizeof(apu->frame_sequencer));
+    apu->agb_soundcnt = 0;
+    apu->agb_soundbias = 0;
+    memset(apu->io + 0x10, 0, 0x17);
+    memset(&apu->pending_gain, 0, sizeof(apu->pending_gain));
+    memcpy(REG_WAVE_TABLE, WAVE_RAM_INITIAL[type], sizeof(WAVE_RAM_INITIAL[type]));
+    memcpy(REG_WAVE_TABLE + sizeof(WAVE_RAM_INITIAL[type]), WAVE_RAM_INITIAL[type], sizeof(WAVE_RAM_INITIAL[type]));
+    update_gains(apu);
+    channel_update_period_all(apu);
+}
+
+unsigned apu_read_io(GbApu* apu, unsigned addr, unsigned time)
+{
+    assert((addr & 0xFF) >= 0x10 && (addr & 0xFF) <= 0x3F);
+    addr &= 0x3F;
+
+    frame_sequencer_catch_up(apu, time);
+
+    if (addr >= 0x30 && addr <= 0x3F)
+    {
+        if (apu_is_agb(apu))
+        {
+            // writes happen to the opposite bank.
+            const bool bank_select = REG_NR30 & 0x40;
+            const unsigned offset = (bank_select ^ 1) ? 16 : 0;
+            return apu->io[addr + offset];
+        }
+        else
+        {
+            if (channel_is_enabled(apu, ChannelType_WAVE))
+            {
+                channel_sync_psg(apu, ChannelType_WAVE, time);
+                if (apu_is_cgb(apu) || apu->wave.just_accessed)
+                {
+                    return REG_WAVE_TABLE[apu->wave.position_counter >> 1];
+                }
+                else
+                {
+                    return 0xFF; // writes to dmg are ignored if wave wasn't just accessed.
+                }
+            }
+        }
+    }
+
+    return apu->io[addr] | IO_READ_VALUE[apu->type][addr];
+}
+
+void apu_write_io(GbApu* apu, unsigned addr, unsigned value, unsigned time)
+{
+    frame_sequencer_catch_up(apu, time);
+    apu->write_io(apu, addr, value, time);
+}
+
+void apu_write_io_batch(GbApu* apu, const GbApuWrite* writes, unsigned count)
+{
+    bool sorted = true;
+    unsigned time = count ? writes[0].time : 0;
+
+    for (unsigned i = 1; i < count; i++)
+    {
+        sorted &= writes[i].time >= writes[i - 1].time;
+        time = apu_min(time, writes[i].time);
+    }
+
+    if (sorted)
+    {
+        for (unsigned i = 0; i < count;)
+        {
+            unsigned n = 1;
+            while (i + n < count && writes[i + n].time == writes[i].time)
+            {
+                n++;
+            }
+
+            write_io_batch_at(apu, writes + i, n, writes[i].time);
+            i += n;
+        }
+    }
+    else
+    {
+        // apply each distinct time in order, writes with the same time
+        // keep their order. this avoids having to sort a copy of the writes.
+        for (unsigned remaining = count; remaining;)
+        {
+            write_io_batch_at(apu, writes, count, time);
+
+            unsigned next_time = UINT32_MAX;
+            remaining = 0;
+            for (unsigned i = 0; i < count; i++)
+            {
+                if (writes[i].time > time)
+                {
+                    next_time = apu_min(next_time, writes[i].time);
+                    remaining++;
+                }
+            }
+            time = next_time;
+        }
+    }
+}
+
+void apu_frame_sequencer_clock(GbApu* apu, unsigned time)
+{
+    assert(!apu->frame_sequencer_timer.enabled && "frame sequencer is clocked internally");
+    frame_sequencer_clock(apu, time);
+}
+
+void apu_frame_sequencer_advance(GbApu* apu, unsigned steps, unsigned time_per_step, unsigned start_time)
+{
+    assert(!apu->frame_sequencer_timer.enabled && "frame sequencer is clocked internally");
+    frame_sequencer_advance(apu, steps, time_per_step, start_time);
+}
+
+void apu_set_frame_sequencer_internal(GbApu* apu, unsigned enable, unsigned period, unsigned clocks_until_next, unsigned time)
+{
+    assert((!enable || period) && "period must not be 0");
+    GbApuFrameSequencerTimer* timer = &apu->frame_sequencer_timer;
+
+    // steps before now are run with the old settings.
+    frame_sequencer_catch_up(apu, time);
+
+    timer->enabled = enable;
+    timer->period = period;
+    timer->next_time = time + clocks_until_next;
+}
+
+void apu_div_reset(GbApu* apu, unsigned time)
+{
+    GbApuFrameSequencerTimer* timer = &apu->frame_sequencer_timer;
+    assert(timer->enabled && "frame sequencer isn't clocked internally");
+
+    frame_sequencer_catch_up(apu, time);
+
+    // the div bit is high for the second half of the period, resetting
+    // div whilst it's high causes a falling edge.
+    if (timer->next_time - time <= timer->period / 2)
+    {
+        frame_sequencer_clock(apu, time);
+    }
+
+    timer->next_time = time + timer->period;
+}
+
+unsigned apu_next_event_time(const GbApu* apu)
+{
+    const GbApuFrameSequencerTimer* timer = &apu->frame_sequencer_timer;
+    if (!timer->enabled)
+    {
+        return (unsigned)-1;
+    }
+
+    // the index isn't advanced whilst disabled, so nothing happens.
+    if (!apu_is_enabled(apu))
+    {
+        return (unsigned)-1;
+    }
+
+    const unsigned steps = frame_sequencer_steps_until_event(apu, (unsigned)-1);
+    if (steps == (unsigned)-1)
+    {
+        return (unsigned)-1;
+    }
+
+    return timer->next_time + steps * timer->period;
 }
 
 unsigned apu_cgb_read_pcm12(GbApu* apu, unsigned time)
 {
     assert(apu_is_cgb(apu) && "invalid access");
+    frame_sequencer_catch_up(apu, time);
     channel_sync_psg(apu, ChannelType_SQUARE0, time);
     channel_sync_psg(apu, ChannelType_SQUARE1, time);
 
     const bool square0_enabled = channel_is_enabled(apu, ChannelType_SQUARE0);
     const bool square1_enabled = channel_is_enabled(apu, ChannelType_SQUARE1);
 
-    const bool square0_duty = SQUARE_DUTY_CYCLES[apu->io[SQAURE_DUTY_ADDR[0]] >> 6][apu->square[0].duty_index];
-    const bool square1_duty = SQUARE_DUTY_CYCLES[apu->io[SQAURE_DUTY_ADDR[1]] >> 6][apu->square[1].duty_index];
+    const bool square0_duty = square_duty_bit(apu->io[SQAURE_DUTY_ADDR[0]] >> 6, apu->square[0].duty_index);
+    const bool square1_duty = square_duty_bit(apu->io[SQAURE_DUTY_ADDR[1]] >> 6, apu->square[1].duty_index);
     const unsigned square0_sample = apu->env[ChannelType_SQUARE0].volume;
     const unsigned square1_sample = apu->env[ChannelType_SQUARE1].volume;
 
@@ -1460,12 +2663,13 @@ unsigned apu_cgb_read_pcm12(GbApu* apu, unsigned time)
 unsigned apu_cgb_read_pcm34(GbApu* apu, unsigned time)
 {
     assert(apu_is_cgb(apu) && "invalid access");
+    frame_sequencer_catch_up(apu, time);
     channel_sync_psg(apu, ChannelType_WAVE, time);
     channel_sync_psg(apu, ChannelType_NOISE, time);
 
     const bool wave_enabled = channel_is_enabled(apu, ChannelType_WAVE);
     const bool noise_enabled = channel_is_enabled(apu, ChannelType_NOISE);
-    const unsigned wave_sample = (apu->wave.position_counter & 0x1) ? apu->wave.sample_buffer & 0xF : apu->wave.sample_buffer >> 4;
+    const unsigned wave_sample = wave_current_sample(&apu->wave);
     const unsigned noise_sample = (apu->noise.lfsr & 0x1) * apu->env[ChannelType_NOISE].volume;
 
     unsigned value = wave_sample * wave_enabled * apu_is_enabled(apu) << 0;
@@ -1474,6 +2678,7 @@ unsigned apu_cgb_read_pcm34(GbApu* apu, unsigned time)
     return value;
 }
 
+#if GB_APU_AGB
 unsigned apu_agb_read8_io(GbApu* apu, unsigned addr, unsigned time)
 {
     assert(apu_is_agb(apu) && "invalid access");
@@ -1510,6 +2715,7 @@ unsigned apu_agb_soundcnt_read(GbApu* apu, unsigned time)
 void apu_agb_soundcnt_write(GbApu* apu, unsigned value, unsigned time)
 {
     assert(apu_is_agb(apu) && "invalid access");
+    frame_sequencer_catch_up(apu, time);
     channel_sync_psg_all(apu, time);
     channel_sync_fifo_all(apu, time);
 
@@ -1523,6 +2729,7 @@ void apu_agb_soundcnt_write(GbApu* apu, unsigned value, unsigned time)
     }
 
     REG_SOUNDCNT_H = value;
+    update_gains(apu);
 }
 
 unsigned apu_agb_soundbias_read(GbApu* apu, unsigned time)
@@ -1590,6 +2797,7 @@ void apu_agb_timer_overflow(GbApu* apu, void* user, apu_agb_fifo_dma_request dma
         }
     }
 }
+#endif // GB_APU_AGB
 
 unsigned apu_read_io_raw(const GbApu* apu, unsigned addr)
 {
@@ -1597,6 +2805,7 @@ unsigned apu_read_io_raw(const GbApu* apu, unsigned addr)
     return apu->io[addr & 0x3F];
 }
 
+#if GB_APU_AGB
 unsigned apu_agb_read_io_raw(const GbApu* apu, unsigned addr)
 {
     addr = AGB_ADDR_TRANSLATION[(addr & 0xFF) - AGB_ADDR_OFFSET];
@@ -1612,25 +2821,215 @@ unsigned apu_agb_soundbias_read_raw(const GbApu* apu)
 {
     return REG_SOUNDBIAS;
 }
+#endif // GB_APU_AGB
 
 void apu_set_channel_volume(GbApu* apu, unsigned channel_num, float volume)
 {
     apu->channel_volume[channel_num] = apu_clamp(volume, 0.0F, 1.0F);
+    update_gains(apu);
 }
 
 void apu_set_master_volume(GbApu* apu, float volume)
 {
-    blip_wrap_set_volume(apu->blip, apu_clamp(volume, 0.0F, 1.0F));
+    apu->master_volume = apu_clamp(volume, 0.0F, 1.0F);
+    blip_wrap_set_volume(apu->blip, apu->master_volume);
+    for (unsigned i = 0; i < apu_array_size(apu->stem); i++)
+    {
+        if (apu->stem[i])
+        {
+            blip_wrap_set_volume(apu->stem[i], apu->master_volume);
+        }
+    }
+    for (unsigned i = 0; i < apu_array_size(apu->parallel_blip); i++)
+    {
+        if (apu->parallel_blip[i])
+        {
+            blip_wrap_set_volume(apu->parallel_blip[i], apu->master_volume);
+        }
+    }
+    update_gains(apu);
 }
 
-void apu_set_bass(GbApu* apu, int frequency)
+void apu_set_ultrasonic_threshold(GbApu* apu, double frequency, double clock_rate)
 {
-    blip_wrap_set_bass(apu->blip, frequency);
+    apu->ultrasonic_period = frequency > 0.0 ? (unsigned)(clock_rate / frequency) : 0;
 }
 
-void apu_set_treble(GbApu* apu, double treble_db)
+unsigned apu_set_event_log(GbApu* apu, unsigned enable)
 {
-    blip_wrap_set_treble(apu->blip, treble_db);
+    if (enable && !apu->event_log)
+    {
+        apu->event_log = calloc(EVENT_LOG_COUNT, sizeof(*apu->event_log));
+        if (!apu->event_log)
+        {
+            return 0;
+        }
+
+        for (unsigned i = 0; i < EVENT_LOG_COUNT; i++)
+        {
+            if (!event_log_reserve(&apu->event_log[i], EVENT_LOG_CAPACITY))
+            {
+                event_log_free(apu);
+                return 0;
+            }
+        }
+    }
+    else if (!enable && apu->event_log)
+    {
+        // deltas already logged this frame still need to be output.
+        event_log_resolve_all(apu);
+        event_log_free(apu);
+    }
+
+    return 1;
+}
+
+// the mix's state with silence, loading it into a stem or parallel buffer starts
+// it at the same resampler offset, so that they output the same number of samples.
+static void silent_mix_state(const GbApu* apu, blip_wrap_state_t* state)
+{
+    blip_wrap_save_state(apu->blip, state);
+    memset(state->integrator, 0, sizeof(state->integrator));
+    memset(state->samples, 0, sizeof(state->samples));
+}
+
+// silences each stem and parallel buffer and aligns it with the mix, see above.
+static void align_to_mix(GbApu* apu)
+{
+    blip_wrap_state_t state;
+    silent_mix_state(apu, &state);
+
+    for (unsigned i = 0; i < apu_array_size(apu->stem); i++)
+    {
+        if (apu->stem[i])
+        {
+            blip_wrap_load_state(apu->stem[i], &state);
+        }
+    }
+
+    for (unsigned i = 0; i < apu_array_size(apu->parallel_blip); i++)
+    {
+        if (apu->parallel_blip[i])
+        {
+            blip_wrap_load_state(apu->parallel_blip[i], &state);
+        }
+    }
+}
+
+unsigned apu_set_parallel_for(GbApu* apu, void* user, apu_parallel_for parallel_for, double clock_rate, double sample_rate)
+{
+    // each channel is synthesised into its own event log and buffer, which
+    // are then mixed together on this thread.
+    if (parallel_for)
+    {
+        if (!apu_set_event_log(apu, 1))
+        {
+            return 0;
+        }
+
+        if (!apu->parallel_blip[0])
+        {
+            for (unsigned i = 0; i < apu_array_size(apu->parallel_blip); i++)
+            {
+                apu->parallel_blip[i] = apu->mono ? blip_wrap_new_mono(sample_rate) : blip_wrap_new(sample_rate);
+                if (!apu->parallel_blip[i] || blip_wrap_set_rates(apu->parallel_blip[i], clock_rate, sample_rate))
+                {
+                    apu_set_parallel_for(apu, NULL, NULL, clock_rate, sample_rate);
+                    return 0;
+                }
+
+                blip_wrap_set_volume(apu->parallel_blip[i], apu->master_volume);
+            }
+
+            align_to_mix(apu);
+        }
+    }
+    else
+    {
+        // buffers are emptied every apu_end_frame(), so nothing is lost.
+        for (unsigned i = 0; i < apu_array_size(apu->parallel_blip); i++)
+        {
+            if (apu->parallel_blip[i])
+            {
+                blip_wrap_delete(apu->parallel_blip[i]);
+                apu->parallel_blip[i] = NULL;
+            }
+        }
+    }
+
+    apu->parallel_for = parallel_for;
+    apu->parallel_user = user;
+    return 1;
+}
+
+unsigned apu_set_stem_output(GbApu* apu, unsigned channel_mask, double clock_rate, double sample_rate)
+{
+    // the fifo channels are always silent unless agb.
+    if (!apu_is_agb(apu))
+    {
+        channel_mask &= ~((1u << ChannelType_FIFOA) | (1u << ChannelType_FIFOB));
+    }
+
+    for (unsigned i = 0; i < apu_array_size(apu->stem); i++)
+    {
+        if (!(channel_mask & (1u << i)))
+        {
+            if (apu->stem[i])
+            {
+                blip_wrap_delete(apu->stem[i]);
+                apu->stem[i] = NULL;
+            }
+        }
+        // stems that already exist are left as is, so their samples are kept.
+        else if (!apu->stem[i])
+        {
+            apu->stem[i] = apu->mono ? blip_wrap_new_mono(sample_rate) : blip_wrap_new(sample_rate);
+            if (!apu->stem[i] || blip_wrap_set_rates(apu->stem[i], clock_rate, sample_rate))
+            {
+                apu_set_stem_output(apu, 0, clock_rate, sample_rate);
+                return 0;
+            }
+
+            blip_wrap_state_t state;
+            silent_mix_state(apu, &state);
+            blip_wrap_set_volume(apu->stem[i], apu->master_volume);
+            blip_wrap_load_state(apu->stem[i], &state);
+        }
+    }
+
+    return 1;
+}
+
+void apu_set_bass(GbApu* apu, int frequency)
+{
+    blip_wrap_set_bass(apu->blip, frequency);
+    for (unsigned i = 0; i < apu_array_size(apu->stem); i++)
+    {
+        if (apu->stem[i])
+        {
+            blip_wrap_set_bass(apu->stem[i], frequency);
+        }
+    }
+}
+
+void apu_set_treble(GbApu* apu, double treble_db)
+{
+    blip_wrap_set_treble(apu->blip, treble_db);
+    for (unsigned i = 0; i < apu_array_size(apu->stem); i++)
+    {
+        if (apu->stem[i])
+        {
+            blip_wrap_set_treble(apu->stem[i], treble_db);
+        }
+    }
+    // deltas are added to these, so they need the same eq as the mix.
+    for (unsigned i = 0; i < apu_array_size(apu->parallel_blip); i++)
+    {
+        if (apu->parallel_blip[i])
+        {
+            blip_wrap_set_treble(apu->parallel_blip[i], treble_db);
+        }
+    }
 }
 
 void apu_set_highpass_filter(GbApu* apu, enum GbApuFilter filter, double clock_rate, double sample_rate)
@@ -1653,28 +3052,88 @@ void apu_set_zombie_mode(GbApu* apu, unsigned enable)
     apu->zombie_mode_enable = enable;
 }
 
+void apu_set_audio_output_enabled(GbApu* apu, unsigned enable, unsigned time)
+{
+    // everything up to time is output (or not) by the current setting, and
+    // deltas added this frame are relative to its start, so end it here.
+    apu_end_frame(apu, time);
+
+    apu->audio_output_disabled = !enable;
+    apu_set_type(apu, apu->type);
+}
+
 void apu_update_timestamp(GbApu* apu, int time)
 {
     for (unsigned i = 0; i < apu_array_size(apu->channels); i++)
     {
         apu->channels[i].timestamp += time;
     }
+
+    for (unsigned i = 0; i < apu_array_size(apu->pending_gain); i++)
+    {
+        apu->pending_gain[i].time += time;
+    }
+
+    apu->frame_sequencer_timer.next_time += time;
 }
 
 int apu_clocks_needed(const GbApu* apu, int sample_count)
 {
-    return blip_wrap_clocks_needed(apu->blip, sample_count);
+    // peeked samples have already been taken out of blip.
+    const int needed = sample_count - apu->peek.count;
+    return blip_wrap_clocks_needed(apu->blip, needed > 0 ? needed : 0);
 }
 
 int apu_samples_avaliable(const GbApu* apu)
 {
-    return blip_wrap_samples_avail(apu->blip);
+    return blip_wrap_samples_avail(apu->blip) + apu->peek.count;
+}
+
+#if GB_APU_OUTPUT_RING
+// moves every available sample into the output ring, samples that don't fit
+// are dropped and counted as overruns.
+static void output_ring_write(GbApu* apu)
+{
+    GbApuOutputRing* ring = &apu->output_ring;
+    const unsigned mask = ring->capacity - 1;
+    const unsigned channels = apu->mono ? 1 : 2;
+    const unsigned head = ring->head;
+    const unsigned used = head - atomic_load_acquire(&ring->tail);
+    const unsigned avail = (unsigned)apu_samples_avaliable(apu);
+
+    // only write whole frames so that left / right stay in order.
+    unsigned count = apu_min(ring->capacity - used, avail);
+    count -= count % channels;
+
+    if (count)
+    {
+        const unsigned index = head & mask;
+        const unsigned first = apu_min(count, ring->capacity - index);
+        apu_read_samples(apu, ring->samples + index, (int)first);
+        apu_read_samples(apu, ring->samples, (int)(count - first));
+        atomic_store_release(&ring->head, head + count);
+    }
+
+    if (count != avail)
+    {
+        short dropped[512];
+        while (apu_read_samples(apu, dropped, apu_array_size(dropped)))
+        {
+        }
+        atomic_store_release(&ring->overruns, ring->overruns + (avail - count));
+    }
 }
 
+#endif // GB_APU_OUTPUT_RING
+
 void apu_end_frame(GbApu* apu, unsigned time)
 {
     // catchup all the channels to the same point.
-    channel_sync_psg_all(apu, time);
+    frame_sequencer_catch_up(apu, time);
+    if (!channel_sync_psg_all_parallel(apu, time))
+    {
+        channel_sync_psg_all(apu, time);
+    }
     channel_sync_fifo_all(apu, time);
 
     // clocks of all channels will be the same as they're synced above.
@@ -1688,20 +3147,51 @@ void apu_end_frame(GbApu* apu, unsigned time)
     }
 
     // make all samples up to this clock point available.
-    blip_wrap_end_frame(apu->blip, clock_duration);
+    if (!apu->audio_output_disabled)
+    {
+        event_log_resolve_all(apu);
+        blip_wrap_end_frame(apu->blip, clock_duration);
+        for (unsigned i = 0; i < apu_array_size(apu->stem); i++)
+        {
+            if (apu->stem[i])
+            {
+                blip_wrap_end_frame(apu->stem[i], clock_duration);
+            }
+        }
+
+        // every frame is ended, even if not synthesised in parallel, so that
+        // they stay aligned with the mix.
+        for (unsigned i = 0; i < apu_array_size(apu->parallel_blip); i++)
+        {
+            if (apu->parallel_blip[i])
+            {
+                blip_wrap_end_frame(apu->parallel_blip[i], clock_duration);
+                blip_wrap_mix(apu->blip, apu->parallel_blip[i]);
+            }
+        }
+
+#if GB_APU_OUTPUT_RING
+        if (apu->output_ring.samples)
+        {
+            output_ring_write(apu);
+        }
+#endif
+    }
 }
 
-int apu_read_samples(GbApu* apu, short out[], int count)
+// reads straight from blip, ignoring peeked samples.
+static int read_samples(GbApu* apu, short out[], int count)
 {
     count = blip_wrap_read_samples(apu->blip, out, count);
 
 #if defined(GB_APU_HAS_MATH_H) && GB_APU_HAS_MATH_H
-    if (apu->capacitor_charge_factor != CAPACITOR_SCALE) /* only apply if enabled. */
+    if (apu->capacitor_charge_factor != 1 << CAPACITOR_SCALE) /* only apply if enabled. */
     {
-        for (int i = 0; i < count; i += 2)
+        // mono only uses the left capacitor.
+        const int stereo_mask = apu->mono ? 0 : 1;
+        for (int i = 0; i < count; i++)
         {
-            out[i + 0] = high_pass(apu->capacitor_charge_factor, out[i + 0], &apu->capacitor[0]);
-            out[i + 1] = high_pass(apu->capacitor_charge_factor, out[i + 1], &apu->capacitor[1]);
+            out[i] = high_pass(apu->capacitor_charge_factor, out[i], &apu->capacitor[i & stereo_mask]);
         }
     }
 #endif
@@ -1709,11 +3199,266 @@ int apu_read_samples(GbApu* apu, short out[], int count)
     return count;
 }
 
+int apu_read_samples(GbApu* apu, short out[], int count)
+{
+    GbApuPeekBuffer* peek = &apu->peek;
+
+    // peeked samples come first.
+    const int peeked = apu_min(count, peek->count);
+    if (peeked)
+    {
+        memcpy(out, peek->samples + peek->start, sizeof(*out) * peeked);
+        apu_consume_samples(apu, peeked);
+    }
+
+    return peeked + read_samples(apu, out + peeked, count - peeked);
+}
+
+unsigned apu_peek_samples(GbApu* apu, const short** samples, int* count)
+{
+    GbApuPeekBuffer* peek = &apu->peek;
+    const int avail = blip_wrap_samples_avail(apu->blip);
+
+    if (avail)
+    {
+        if (peek->count + avail > peek->capacity)
+        {
+            short* buf = realloc(peek->samples, sizeof(*buf) * (peek->count + avail));
+            if (!buf)
+            {
+                return 0;
+            }
+            peek->samples = buf;
+            peek->capacity = peek->count + avail;
+        }
+
+        // keep the unconsumed samples contiguous with the new ones.
+        if (peek->start)
+        {
+            memmove(peek->samples, peek->samples + peek->start, sizeof(*peek->samples) * peek->count);
+            peek->start = 0;
+        }
+
+        peek->count += read_samples(apu, peek->samples + peek->count, avail);
+    }
+
+    *samples = peek->samples + peek->start;
+    *count = peek->count;
+    return 1;
+}
+
+void apu_consume_samples(GbApu* apu, int count)
+{
+    GbApuPeekBuffer* peek = &apu->peek;
+    assert(count >= 0 && count <= peek->count && "consumed more than peeked");
+
+    peek->start += count;
+    peek->count -= count;
+
+    if (!peek->count)
+    {
+        peek->start = 0;
+    }
+}
+
+// left and right samples are written to every step'th element of out_l / out_r.
+// when mono, every sample is written to out_l.
+static int read_samples_s32(GbApu* apu, int out_l[], int out_r[], int step, int count)
+{
+    assert(!apu->peek.count && "consume peeked samples before reading another format");
+    count = blip_wrap_read_samples_s32(apu->blip, out_l, out_r, step, count);
+
+#if defined(GB_APU_HAS_MATH_H) && GB_APU_HAS_MATH_H
+    if (apu->capacitor_charge_factor != 1 << CAPACITOR_SCALE && apu->mono)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            out_l[i * step] = high_pass_unclamped(apu->capacitor_charge_factor, out_l[i * step], &apu->capacitor[0]);
+        }
+    }
+    else if (apu->capacitor_charge_factor != 1 << CAPACITOR_SCALE) /* only apply if enabled. */
+    {
+        for (int i = 0; i < count / 2; i++)
+        {
+            out_l[i * step] = high_pass_unclamped(apu->capacitor_charge_factor, out_l[i * step], &apu->capacitor[0]);
+            out_r[i * step] = high_pass_unclamped(apu->capacitor_charge_factor, out_r[i * step], &apu->capacitor[1]);
+        }
+    }
+#endif
+
+    return count;
+}
+
+static int read_samples_f32(GbApu* apu, float out_l[], float out_r[], int step, int count)
+{
+    assert(!apu->peek.count && "consume peeked samples before reading another format");
+
+#if defined(GB_APU_HAS_MATH_H) && GB_APU_HAS_MATH_H
+    // the filter works on integer samples, so go through the s32 path.
+    if (apu->capacitor_charge_factor != 1 << CAPACITOR_SCALE) /* only apply if enabled. */
+    {
+        const float scale = 1.0F / 32768;
+        const int channels = apu->mono ? 1 : 2;
+        int temp[2][512];
+        int total = 0;
+
+        while (total < count)
+        {
+            const int chunk = apu_min(count - total, (int)apu_array_size(temp[0]) * channels);
+            const int read = read_samples_s32(apu, temp[0], temp[1], 1, chunk);
+            if (!read)
+            {
+                break;
+            }
+
+            for (int i = 0; i < read / channels; i++)
+            {
+                out_l[(total / channels + i) * step] = temp[0][i] * scale;
+                if (!apu->mono)
+                {
+                    out_r[(total / channels + i) * step] = temp[1][i] * scale;
+                }
+            }
+            total += read;
+        }
+
+        return total;
+    }
+#endif
+
+    return blip_wrap_read_samples_f32(apu->blip, out_l, out_r, step, count);
+}
+
+int apu_read_samples_s32(GbApu* apu, int out[], int count)
+{
+    if (apu->mono)
+    {
+        return read_samples_s32(apu, out, NULL, 1, count);
+    }
+    return read_samples_s32(apu, out, out + 1, 2, count);
+}
+
+int apu_read_samples_f32(GbApu* apu, float out[], int count)
+{
+    if (apu->mono)
+    {
+        return read_samples_f32(apu, out, NULL, 1, count);
+    }
+    return read_samples_f32(apu, out, out + 1, 2, count);
+}
+
+int apu_read_samples_planar_s32(GbApu* apu, int out_l[], int out_r[], int count)
+{
+    return read_samples_s32(apu, out_l, out_r, 1, count);
+}
+
+int apu_read_samples_planar_f32(GbApu* apu, float out_l[], float out_r[], int count)
+{
+    return read_samples_f32(apu, out_l, out_r, 1, count);
+}
+
+int apu_read_channel_samples(GbApu* apu, unsigned channel_num, short out[], int count)
+{
+    assert(channel_num < apu_array_size(apu->stem) && "invalid channel_num");
+    assert(apu->stem[channel_num] && "stem output not enabled");
+
+    return blip_wrap_read_samples(apu->stem[channel_num], out, count);
+}
+
 void apu_clear_samples(GbApu* apu)
 {
+    apu_consume_samples(apu, apu->peek.count);
+    event_log_clear(apu);
     blip_wrap_clear(apu->blip);
+    for (unsigned i = 0; i < apu_array_size(apu->stem); i++)
+    {
+        if (apu->stem[i])
+        {
+            blip_wrap_clear(apu->stem[i]);
+        }
+    }
+    for (unsigned i = 0; i < apu_array_size(apu->parallel_blip); i++)
+    {
+        if (apu->parallel_blip[i])
+        {
+            blip_wrap_clear(apu->parallel_blip[i]);
+        }
+    }
+}
+
+#if GB_APU_OUTPUT_RING
+unsigned apu_output_ring_init(GbApu* apu, unsigned capacity)
+{
+    GbApuOutputRing* ring = &apu->output_ring;
+
+    free(ring->samples);
+    memset(ring, 0, sizeof(*ring));
+
+    if (!capacity)
+    {
+        return 1;
+    }
+
+    // round up to a power of 2 so the index can be masked.
+    if (capacity > 1U << 30)
+    {
+        return 0;
+    }
+    ring->capacity = 2;
+    while (ring->capacity < capacity)
+    {
+        ring->capacity <<= 1;
+    }
+
+    ring->samples = malloc(sizeof(*ring->samples) * ring->capacity);
+    if (!ring->samples)
+    {
+        apu_output_ring_init(apu, 0);
+        return 0;
+    }
+
+    return 1;
+}
+
+int apu_output_ring_read(GbApu* apu, short out[], int count)
+{
+    GbApuOutputRing* ring = &apu->output_ring;
+    assert(ring->samples && "output ring not enabled");
+    assert(count >= 0 && "invalid count");
+
+    // only read whole frames so that left / right stay in order.
+    count -= count % (apu->mono ? 1 : 2);
+
+    const unsigned mask = ring->capacity - 1;
+    const unsigned tail = ring->tail;
+    const unsigned avail = atomic_load_acquire(&ring->head) - tail;
+    const unsigned read = apu_min((unsigned)count, avail);
+
+    const unsigned index = tail & mask;
+    const unsigned first = apu_min(read, ring->capacity - index);
+    memcpy(out, ring->samples + index, sizeof(*out) * first);
+    memcpy(out + first, ring->samples, sizeof(*out) * (read - first));
+    atomic_store_release(&ring->tail, tail + read);
+
+    if (read != (unsigned)count)
+    {
+        atomic_store_release(&ring->underruns, ring->underruns + ((unsigned)count - read));
+    }
+
+    return (int)read;
+}
+
+unsigned apu_output_ring_underruns(const GbApu* apu)
+{
+    return atomic_load_acquire(&apu->output_ring.underruns);
 }
 
+unsigned apu_output_ring_overruns(const GbApu* apu)
+{
+    return atomic_load_acquire(&apu->output_ring.overruns);
+}
+#endif // GB_APU_OUTPUT_RING
+
 #if (defined(__cplusplus) && __cplusplus < 201103L) || (!defined(static_assert))
   #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
     #define static_assert _Static_assert
@@ -1734,11 +3479,165 @@ static_assert(offsetof(GbApu, frame_sequencer) == 248, "bad frame_sequencer offs
 static_assert(offsetof(GbApu, agb_soundcnt) == 252, "bad agb_soundcnt offset, save states broken!");
 static_assert(offsetof(GbApu, agb_soundbias) == 254, "bad agb_soundbias offset, save states broken!");
 static_assert(offsetof(GbApu, io) == 256, "bad io offset, save states broken!");
-static_assert(offsetof(GbApu, blip) == 336, "bad blip offset, save states broken!");
+static_assert(offsetof(GbApu, pending_gain) == 336, "bad pending_gain offset, save states broken!");
+static_assert(offsetof(GbApu, frame_sequencer_timer) == 368, "bad frame_sequencer_timer offset, save states broken!");
+static_assert(offsetof(GbApu, blip) == 384, "bad blip offset, save states broken!");
+
+// everything not in the savestate is derived from it, so update it.
+static void on_state_loaded(GbApu* apu)
+{
+    update_gains(apu);
+    channel_update_period_all(apu);
+}
+
+// the frame sequencer timer is host configuration that states before version 3
+// don't have, so it's kept and the next step is a period after the state's time.
+static void on_state_loaded_without_timer(GbApu* apu, const GbApuFrameSequencerTimer* timer)
+{
+    unsigned time = apu->channels[0].timestamp;
+    for (unsigned i = 1; i < apu_array_size(apu->channels); i++)
+    {
+        if ((int)(apu->channels[i].timestamp - time) > 0)
+        {
+            time = apu->channels[i].timestamp;
+        }
+    }
+
+    apu->frame_sequencer_timer = *timer;
+    apu->frame_sequencer_timer.next_time = time + timer->period;
+}
+
+// the in-memory layout of the savestate fields, only compatible with the
+// same build. used by apu_load_state_legacy() and snapshots.
+enum { RAW_STATE_SIZE = offsetof(GbApu, blip) };
+// the raw layout loaded by apu_load_state_legacy(), fields after it are reset.
+enum { LEGACY_STATE_SIZE = offsetof(GbApu, pending_gain) };
+
+// savestates are a header followed by every field in STATE_FIELDS, stored
+// little-endian without padding. the header is the magic "GAPU", a u16 version,
+// a u16 that is reserved and a u32 size of the fields that follow.
+enum { STATE_MAGIC = 0x55504147 };
+enum { STATE_VERSION = 3 };
+enum { STATE_HEADER_SIZE = 12 };
+
+typedef struct GbApuStateField
+{
+    uint16_t offset; /* offset of the first element in GbApu. */
+    uint8_t size; /* size of each element, 1, 2 or 4 bytes. */
+    uint8_t count; /* number of elements. */
+    uint16_t stride; /* distance between each element in GbApu. */
+    uint16_t version; /* version that the field was added in. */
+} GbApuStateField;
+
+#define STATE_FIELD(version, member, count, stride) \
+    { offsetof(GbApu, member), sizeof(((GbApu*)0)->member), count, stride, version }
+
+// only ever append to this, bumping STATE_VERSION, so old states still load.
+static const GbApuStateField STATE_FIELDS[] = {
+    STATE_FIELD(1, channels[0].clock, 6, sizeof(GbApuChannel)),
+    STATE_FIELD(1, channels[0].timestamp, 6, sizeof(GbApuChannel)),
+    STATE_FIELD(1, channels[0].frequency_timer, 6, sizeof(GbApuChannel)),
+    STATE_FIELD(1, channels[0].amp[0], 6, sizeof(GbApuChannel)),
+    STATE_FIELD(1, channels[0].amp[1], 6, sizeof(GbApuChannel)),
+    STATE_FIELD(1, len[0].counter, 4, sizeof(GbApuLen)),
+    STATE_FIELD(1, env[0].volume, 4, sizeof(GbApuEnvelope)),
+    STATE_FIELD(1, env[0].timer, 4, sizeof(GbApuEnvelope)),
+    STATE_FIELD(1, env[0].disable, 4, sizeof(GbApuEnvelope)),
+    STATE_FIELD(1, sweep.freq_shadow_register, 1, 0),
+    STATE_FIELD(1, sweep.timer, 1, 0),
+    STATE_FIELD(1, sweep.enabled, 1, 0),
+    STATE_FIELD(1, sweep.did_negate, 1, 0),
+    STATE_FIELD(1, square[0].duty_index, 2, sizeof(GbApuSquare)),
+    STATE_FIELD(1, wave.position_counter, 1, 0),
+    STATE_FIELD(1, wave.sample_buffer, 1, 0),
+    STATE_FIELD(1, wave.just_accessed, 1, 0),
+    STATE_FIELD(1, noise.lfsr, 1, 0),
+    STATE_FIELD(1, fifo[0].ring_buf[0], FIFO_CAPACITY, sizeof(uint32_t)),
+    STATE_FIELD(1, fifo[1].ring_buf[0], FIFO_CAPACITY, sizeof(uint32_t)),
+    STATE_FIELD(1, fifo[0].r_index, 2, sizeof(GbApuFifo)),
+    STATE_FIELD(1, fifo[0].w_index, 2, sizeof(GbApuFifo)),
+    STATE_FIELD(1, fifo[0].playing_buffer, 2, sizeof(GbApuFifo)),
+    STATE_FIELD(1, fifo[0].playing_buffer_index, 2, sizeof(GbApuFifo)),
+    STATE_FIELD(1, fifo[0].current_sample, 2, sizeof(GbApuFifo)),
+    STATE_FIELD(1, frame_sequencer.index, 1, 0),
+    STATE_FIELD(1, agb_soundcnt, 1, 0),
+    STATE_FIELD(1, agb_soundbias, 1, 0),
+    STATE_FIELD(1, io[0], sizeof(((GbApu*)0)->io), 1),
+    STATE_FIELD(2, pending_gain[0].time, 4, sizeof(GbApuPendingGain)),
+    STATE_FIELD(2, pending_gain[0].nr50, 4, sizeof(GbApuPendingGain)),
+    STATE_FIELD(2, pending_gain[0].nr51, 4, sizeof(GbApuPendingGain)),
+    STATE_FIELD(2, pending_gain[0].pending, 4, sizeof(GbApuPendingGain)),
+    STATE_FIELD(3, frame_sequencer_timer.next_time, 1, 0),
+    STATE_FIELD(3, frame_sequencer_timer.period, 1, 0),
+    STATE_FIELD(3, frame_sequencer_timer.enabled, 1, 0),
+};
+
+#undef STATE_FIELD
+
+static_assert(sizeof(bool) == 1, "bool fields are saved as 1 byte, save states broken!");
+
+// extended savestates are a normal savestate followed by this, stored as
+// little-endian u64 offset, then every other value as an i32 in order.
+typedef struct GbApuStateEx
+{
+    blip_wrap_state_t blip;
+    int32_t capacitor[2];
+} GbApuStateEx;
+
+enum { STATE_EX_SIZE = 8 + 4 * (2 + BLIP_WRAP_STATE_SAMPLES * 2 + 2) };
+
+static void state_write(uint8_t* data, uint32_t value, unsigned size)
+{
+    for (unsigned i = 0; i < size; i++)
+    {
+        data[i] = (uint8_t)(value >> (i * 8));
+    }
+}
+
+static uint32_t state_read(const uint8_t* data, unsigned size)
+{
+    uint32_t value = 0;
+    for (unsigned i = 0; i < size; i++)
+    {
+        value |= (uint32_t)data[i] << (i * 8);
+    }
+    return value;
+}
+
+static unsigned state_fields_size(unsigned version)
+{
+    unsigned size = 0;
+    for (unsigned i = 0; i < apu_array_size(STATE_FIELDS); i++)
+    {
+        if (STATE_FIELDS[i].version <= version)
+        {
+            size += STATE_FIELDS[i].size * STATE_FIELDS[i].count;
+        }
+    }
+    return size;
+}
+
+// returns the version of the state, or 0 if it's not a valid state.
+static unsigned state_check_header(const uint8_t* data, unsigned size)
+{
+    if (!data || size < STATE_HEADER_SIZE || state_read(data + 0, 4) != STATE_MAGIC)
+    {
+        return 0;
+    }
+
+    const unsigned version = state_read(data + 4, 2);
+    const unsigned fields_size = state_read(data + 8, 4);
+    if (!version || version > STATE_VERSION || fields_size != state_fields_size(version) || size - STATE_HEADER_SIZE < fields_size)
+    {
+        return 0;
+    }
+
+    return version;
+}
 
 unsigned apu_state_size(void)
 {
-    return offsetof(GbApu, blip);
+    return STATE_HEADER_SIZE + state_fields_size(STATE_VERSION);
 }
 
 unsigned apu_save_state(const GbApu* apu, void* data, unsigned size)
@@ -1749,18 +3648,440 @@ unsigned apu_save_state(const GbApu* apu, void* data, unsigned size)
         return 0;
     }
 
-    memcpy(data, apu, state_size);
+    uint8_t* out = (uint8_t*)data;
+    state_write(out + 0, STATE_MAGIC, 4);
+    state_write(out + 4, STATE_VERSION, 2);
+    state_write(out + 6, 0, 2);
+    state_write(out + 8, state_size - STATE_HEADER_SIZE, 4);
+    out += STATE_HEADER_SIZE;
+
+    for (unsigned i = 0; i < apu_array_size(STATE_FIELDS); i++)
+    {
+        const GbApuStateField field = STATE_FIELDS[i];
+        const uint8_t* in = (const uint8_t*)apu + field.offset;
+
+        for (unsigned j = 0; j < field.count; j++, in += field.stride, out += field.size)
+        {
+            uint32_t value = 0;
+            switch (field.size)
+            {
+                case 1: { uint8_t v; memcpy(&v, in, 1); value = v; } break;
+                case 2: { uint16_t v; memcpy(&v, in, 2); value = v; } break;
+                case 4: { uint32_t v; memcpy(&v, in, 4); value = v; } break;
+            }
+            state_write(out, value, field.size);
+        }
+    }
+
     return state_size;
 }
 
 unsigned apu_load_state(GbApu* apu, const void* data, unsigned size)
 {
-    const unsigned state_size = apu_state_size();
+    const uint8_t* in = (const uint8_t*)data;
+    const unsigned version = state_check_header(in, size);
+    if (!version)
+    {
+        return 0;
+    }
+
+    in += STATE_HEADER_SIZE;
+    const GbApuFrameSequencerTimer timer = apu->frame_sequencer_timer;
+
+    for (unsigned i = 0; i < apu_array_size(STATE_FIELDS); i++)
+    {
+        const GbApuStateField field = STATE_FIELDS[i];
+        uint8_t* out = (uint8_t*)apu + field.offset;
+
+        // fields newer than the state are reset.
+        const bool present = field.version <= version;
+
+        for (unsigned j = 0; j < field.count; j++, out += field.stride)
+        {
+            uint32_t value = 0;
+            if (present)
+            {
+                value = state_read(in, field.size);
+                in += field.size;
+            }
+
+            switch (field.size)
+            {
+                case 1: { const uint8_t v = value; memcpy(out, &v, 1); } break;
+                case 2: { const uint16_t v = value; memcpy(out, &v, 2); } break;
+                case 4: { const uint32_t v = value; memcpy(out, &v, 4); } break;
+            }
+        }
+    }
+
+    if (version < 3)
+    {
+        on_state_loaded_without_timer(apu, &timer);
+    }
+
+    on_state_loaded(apu);
+    return STATE_HEADER_SIZE + state_fields_size(version);
+}
+
+unsigned apu_load_state_legacy(GbApu* apu, const void* data, unsigned size)
+{
+    if (!data || size < LEGACY_STATE_SIZE)
+    {
+        return 0;
+    }
+
+    const GbApuFrameSequencerTimer timer = apu->frame_sequencer_timer;
+    memcpy(apu, data, LEGACY_STATE_SIZE);
+    memset((uint8_t*)apu + LEGACY_STATE_SIZE, 0, RAW_STATE_SIZE - LEGACY_STATE_SIZE);
+    on_state_loaded_without_timer(apu, &timer);
+    on_state_loaded(apu);
+    return LEGACY_STATE_SIZE;
+}
+
+unsigned apu_state_size_ex(void)
+{
+    return apu_state_size() + STATE_EX_SIZE;
+}
+
+unsigned apu_save_state_ex(const GbApu* apu, void* data, unsigned size)
+{
+    const unsigned state_size = apu_state_size_ex();
     if (!data || size < state_size)
     {
         return 0;
     }
 
-    memcpy(apu, data, state_size);
+    // pending output is only known at the end of a frame.
+    for (unsigned i = 0; i < apu_array_size(apu->channels); i++)
+    {
+        assert(apu->channels[i].clock == 0 && "call apu_end_frame() first");
+    }
+
+    GbApuStateEx ex;
+    memset(&ex, 0, sizeof(ex));
+    blip_wrap_save_state(apu->blip, &ex.blip);
+#if defined(GB_APU_HAS_MATH_H) && GB_APU_HAS_MATH_H
+    ex.capacitor[0] = apu->capacitor[0];
+    ex.capacitor[1] = apu->capacitor[1];
+#endif
+
+    uint8_t* out = (uint8_t*)data + apu_save_state(apu, data, size);
+    state_write(out + 0, (uint32_t)ex.blip.offset, 4);
+    state_write(out + 4, (uint32_t)(ex.blip.offset >> 32), 4);
+    out += 8;
+    for (unsigned i = 0; i < 2; i++, out += 4)
+    {
+        state_write(out, (uint32_t)ex.blip.integrator[i], 4);
+    }
+    for (unsigned i = 0; i < BLIP_WRAP_STATE_SAMPLES * 2; i++, out += 4)
+    {
+        state_write(out, (uint32_t)ex.blip.samples[i / 2][i % 2], 4);
+    }
+    for (unsigned i = 0; i < 2; i++, out += 4)
+    {
+        state_write(out, (uint32_t)ex.capacitor[i], 4);
+    }
+
     return state_size;
 }
+
+unsigned apu_load_state_ex(GbApu* apu, const void* data, unsigned size)
+{
+    const uint8_t* in = (const uint8_t*)data;
+    const unsigned version = state_check_header(in, size);
+    if (!version)
+    {
+        return 0;
+    }
+
+    const unsigned base_size = STATE_HEADER_SIZE + state_fields_size(version);
+    if (size - base_size < STATE_EX_SIZE)
+    {
+        return 0;
+    }
+
+    GbApuStateEx ex;
+    in += base_size;
+    ex.blip.offset = state_read(in + 0, 4) | (unsigned long long)state_read(in + 4, 4) << 32;
+    in += 8;
+    for (unsigned i = 0; i < 2; i++, in += 4)
+    {
+        ex.blip.integrator[i] = (int32_t)state_read(in, 4);
+    }
+    for (unsigned i = 0; i < BLIP_WRAP_STATE_SAMPLES * 2; i++, in += 4)
+    {
+        ex.blip.samples[i / 2][i % 2] = (int32_t)state_read(in, 4);
+    }
+    for (unsigned i = 0; i < 2; i++, in += 4)
+    {
+        ex.capacitor[i] = (int32_t)state_read(in, 4);
+    }
+
+    apu_load_state(apu, data, size);
+    apu_consume_samples(apu, apu->peek.count);
+    event_log_clear(apu);
+    blip_wrap_load_state(apu->blip, &ex.blip);
+    align_to_mix(apu);
+#if defined(GB_APU_HAS_MATH_H) && GB_APU_HAS_MATH_H
+    apu->capacitor[0] = ex.capacitor[0];
+    apu->capacitor[1] = ex.capacitor[1];
+#endif
+
+    return base_size + STATE_EX_SIZE;
+}
+
+// each snapshot run is a uint16 count of unchanged bytes to skip, followed by
+// a uint16 length and that many bytes to xor with the keyframe.
+enum { SNAPSHOT_RUN_HEADER = 4 };
+
+static void snapshot_write16(uint8_t* data, unsigned value)
+{
+    const uint16_t v = value;
+    memcpy(data, &v, sizeof(v));
+}
+
+static unsigned snapshot_read16(const uint8_t* data)
+{
+    uint16_t v;
+    memcpy(&v, data, sizeof(v));
+    return v;
+}
+
+// encodes the difference between the keyframe and state into scratch.
+// unchanged gaps shorter than a run header are included in the run.
+// returns the encoded size, which is at most the state size + SNAPSHOT_RUN_HEADER.
+static unsigned snapshot_encode(uint8_t* scratch, const uint8_t* keyframe, const uint8_t* state, unsigned size)
+{
+    unsigned out = 0;
+    unsigned pos = 0;
+
+    for (unsigned i = 0; i < size; i++)
+    {
+        if (keyframe[i] == state[i])
+        {
+            continue;
+        }
+
+        unsigned len = 1;
+        unsigned unchanged = 0;
+        for (unsigned j = i + 1; j < size && unchanged <= SNAPSHOT_RUN_HEADER; j++)
+        {
+            if (keyframe[j] != state[j])
+            {
+                len = j - i + 1;
+                unchanged = 0;
+            }
+            else
+            {
+                unchanged++;
+            }
+        }
+
+        snapshot_write16(scratch + out + 0, i - pos);
+        snapshot_write16(scratch + out + 2, len);
+        out += SNAPSHOT_RUN_HEADER;
+
+        for (unsigned j = 0; j < len; j++)
+        {
+            scratch[out++] = keyframe[i + j] ^ state[i + j];
+        }
+
+        pos = i + len;
+        i = pos - 1;
+    }
+
+    return out;
+}
+
+static void snapshot_apply(const GbApuSnapshot* snapshot, uint8_t* state)
+{
+    unsigned pos = 0;
+
+    for (unsigned i = 0; i < snapshot->size;)
+    {
+        pos += snapshot_read16(snapshot->data + i + 0);
+        const unsigned len = snapshot_read16(snapshot->data + i + 2);
+        i += SNAPSHOT_RUN_HEADER;
+
+        for (unsigned j = 0; j < len; j++)
+        {
+            state[pos++] ^= snapshot->data[i++];
+        }
+    }
+}
+
+static bool snapshot_store(GbApuSnapshot* snapshot, const uint8_t* scratch, unsigned size)
+{
+    if (size > snapshot->capacity)
+    {
+        uint8_t* data = realloc(snapshot->data, size);
+        if (!data)
+        {
+            return false;
+        }
+        snapshot->data = data;
+        snapshot->capacity = size;
+    }
+
+    if (size)
+    {
+        memcpy(snapshot->data, scratch, size);
+    }
+    snapshot->size = size;
+    return true;
+}
+
+static unsigned snapshot_slot(const GbApuSnapshotRing* ring, unsigned age)
+{
+    return (ring->newest + ring->slot_count - age) % ring->slot_count;
+}
+
+// returns the index of an unused keyframe set to state, or slot_count on faliure.
+// there's always an unused one as each live keyframe is used by a live snapshot.
+static unsigned snapshot_new_keyframe(GbApuSnapshotRing* ring, const uint8_t* state, unsigned size)
+{
+    unsigned index = ring->slot_count;
+
+    // prefer one that's already allocated.
+    for (unsigned i = 0; i < ring->slot_count; i++)
+    {
+        if (!ring->keyframes[i].refs && (ring->keyframes[i].data || index == ring->slot_count))
+        {
+            index = i;
+            if (ring->keyframes[i].data)
+            {
+                break;
+            }
+        }
+    }
+
+    assert(index != ring->slot_count && "no unused keyframe");
+    GbApuSnapshotKeyframe* keyframe = &ring->keyframes[index];
+
+    if (!keyframe->data)
+    {
+        keyframe->data = malloc(size);
+        if (!keyframe->data)
+        {
+            return ring->slot_count;
+        }
+    }
+
+    memcpy(keyframe->data, state, size);
+    return index;
+}
+
+unsigned apu_snapshot_init(GbApu* apu, unsigned slot_count)
+{
+    GbApuSnapshotRing* ring = &apu->snapshots;
+
+    for (unsigned i = 0; i < ring->slot_count; i++)
+    {
+        free(ring->slots[i].data);
+        free(ring->keyframes[i].data);
+    }
+    free(ring->slots);
+    free(ring->keyframes);
+    free(ring->scratch);
+    memset(ring, 0, sizeof(*ring));
+
+    if (!slot_count)
+    {
+        return 1;
+    }
+
+    ring->slots = calloc(slot_count, sizeof(*ring->slots));
+    ring->keyframes = calloc(slot_count, sizeof(*ring->keyframes));
+    ring->scratch = malloc(RAW_STATE_SIZE + SNAPSHOT_RUN_HEADER);
+    ring->slot_count = slot_count;
+
+    if (!ring->slots || !ring->keyframes || !ring->scratch)
+    {
+        apu_snapshot_init(apu, 0);
+        return 0;
+    }
+
+    return 1;
+}
+
+unsigned apu_snapshot_push(GbApu* apu)
+{
+    GbApuSnapshotRing* ring = &apu->snapshots;
+    const unsigned size = RAW_STATE_SIZE;
+    const uint8_t* state = (const uint8_t*)apu;
+
+    if (!ring->slot_count)
+    {
+        return 0;
+    }
+
+    const unsigned slot = ring->count ? (ring->newest + 1) % ring->slot_count : ring->newest;
+
+    // when full, the oldest snapshot is replaced, which frees its keyframe
+    // once the rest of its group has also aged out.
+    if (ring->count == ring->slot_count)
+    {
+        ring->keyframes[ring->slots[slot].keyframe].refs--;
+        ring->count--;
+    }
+
+    unsigned keyframe = ring->keyframe;
+    unsigned encoded_size = ring->count ? snapshot_encode(ring->scratch, ring->keyframes[keyframe].data, state, size) : size;
+
+    // once the state has drifted far from the keyframe, snapshots become
+    // large, so start a new group keyed on this state, which is likely closer
+    // to the next. older snapshots keep their own keyframe.
+    if (encoded_size > size / 4)
+    {
+        keyframe = snapshot_new_keyframe(ring, state, size);
+        if (keyframe == ring->slot_count)
+        {
+            return 0;
+        }
+        encoded_size = 0;
+    }
+
+    if (!snapshot_store(&ring->slots[slot], ring->scratch, encoded_size))
+    {
+        return 0;
+    }
+
+    ring->slots[slot].keyframe = keyframe;
+    ring->keyframes[keyframe].refs++;
+    ring->keyframe = keyframe;
+    ring->newest = slot;
+    ring->count++;
+    return 1;
+}
+
+unsigned apu_snapshot_restore(GbApu* apu, unsigned age)
+{
+    GbApuSnapshotRing* ring = &apu->snapshots;
+
+    if (age >= ring->count)
+    {
+        return 0;
+    }
+
+    // newer snapshots are from a timeline that no longer exists.
+    for (unsigned i = 0; i < age; i++)
+    {
+        ring->keyframes[ring->slots[snapshot_slot(ring, i)].keyframe].refs--;
+    }
+
+    const unsigned slot = snapshot_slot(ring, age);
+    const GbApuSnapshot* snapshot = &ring->slots[slot];
+    memcpy(apu, ring->keyframes[snapshot->keyframe].data, RAW_STATE_SIZE);
+    snapshot_apply(snapshot, (uint8_t*)apu);
+    on_state_loaded(apu);
+
+    ring->keyframe = snapshot->keyframe;
+    ring->newest = slot;
+    ring->count -= age;
+    return 1;
+}
+
+unsigned apu_snapshot_count(const GbApu* apu)
+{
+    return apu->snapshots.count;
+}
@@ -28,13 +28,28 @@ enum GbApuClockRate
 };
 
 typedef struct GbApu GbApu;
+
+typedef struct GbApuWrite
+{
+    unsigned addr;
+    unsigned value;
+    unsigned time;
+} GbApuWrite;
 typedef void(*apu_agb_fifo_dma_request)(void* user, unsigned fifo_num, unsigned time);
+/* calls task(data, i) for every i in [0, count), possibly in parallel, */
+/* and only returns once all of them have finished. */
+typedef void(*apu_parallel_task)(void* data, unsigned index);
+typedef void(*apu_parallel_for)(void* user, apu_parallel_task task, void* data, unsigned count);
 
 /* ------------------------- */
 /* ------Initialise Api----- */
 /* ------------------------- */
 /* ensure you call this at start-up. */
 GbApu* apu_init(double clock_rate, double sample_rate);
+/* same as above, but only a single channel is output, the average of left */
+/* and right. every sample output / count is then a mono sample, and the */
+/* planar functions only write to out_l. */
+GbApu* apu_init_mono(double clock_rate, double sample_rate);
 /* call to free allocated memory by blip buf. */
 void apu_quit(GbApu*);
 /* clock_rate should be the cpu speed of the system. */
@@ -47,8 +62,27 @@ void apu_reset(GbApu*, enum GbApuType type);
 unsigned apu_read_io(GbApu*, unsigned addr, unsigned time);
 /* writes to an io register. */
 void apu_write_io(GbApu*, unsigned addr, unsigned value, unsigned time);
+/* same as calling apu_write_io() for each write in order of time, writes with */
+/* the same time are applied in the order given. faster than calling */
+/* apu_write_io() when many writes share the same time. */
+void apu_write_io_batch(GbApu*, const GbApuWrite* writes, unsigned count);
 /* call this on the falling edge of bit 4/5 of DIV. */
+/* not needed if the frame sequencer is clocked internally, see below. */
 void apu_frame_sequencer_clock(GbApu*, unsigned time);
+/* same as calling apu_frame_sequencer_clock() steps times, starting at start_time */
+/* and time_per_step apart. much faster when fast-forwarding. */
+void apu_frame_sequencer_advance(GbApu*, unsigned steps, unsigned time_per_step, unsigned start_time);
+/* clocks the frame sequencer internally, rather than calling apu_frame_sequencer_clock(). */
+/* period is the time between falling edges of the DIV bit, clocks_until_next is */
+/* the time until the next falling edge. call again when the period changes, */
+/* such as when switching cgb speed. this setting is kept across apu_reset(). */
+void apu_set_frame_sequencer_internal(GbApu*, unsigned enable, unsigned period, unsigned clocks_until_next, unsigned time);
+/* call when DIV is written to, only used when clocked internally. */
+void apu_div_reset(GbApu*, unsigned time);
+/* returns the time the frame sequencer next changes the state of a channel, */
+/* or (unsigned)-1 if it won't until a register is written. */
+/* this is only informational, the frame sequencer is caught up when needed. */
+unsigned apu_next_event_time(const GbApu*);
 
 /* ------------------------- */
 /* ------CGB Functions------ */
@@ -60,6 +94,7 @@ unsigned apu_cgb_read_pcm34(GbApu*, unsigned time);
 /* ------------------------- */
 /* ------AGB Functions------ */
 /* ------------------------- */
+/* not available if built with GB_APU_AGB=0. */
 /* translates agb addr to dmg and calls apu_read_io, unused bits are masked. */
 unsigned apu_agb_read8_io(GbApu*, unsigned addr, unsigned time);
 /* translates agb addr to dmg and calls apu_write_io. */
@@ -85,7 +120,7 @@ void apu_agb_timer_overflow(GbApu*, void* user, apu_agb_fifo_dma_request dma_cal
 /* ------------------------- */
 /* returns value of io register, without unused bits applied / masked, */
 /* regardless if the apu is enabled or not. */
-/* useful for gui io viewer. */
+/* useful for gui io viewer, apu_agb_* require GB_APU_AGB. */
 unsigned apu_read_io_raw(const GbApu*, unsigned addr);
 unsigned apu_agb_read_io_raw(const GbApu*, unsigned addr);
 unsigned apu_agb_soundcnt_read_raw(const GbApu*);
@@ -98,6 +133,25 @@ unsigned apu_agb_soundbias_read_raw(const GbApu*);
 void apu_set_channel_volume(GbApu*, unsigned channel_num, float volume);
 /* master volume, max range: 0.0 - 1.0. */
 void apu_set_master_volume(GbApu*, float volume);
+/* square and wave channels that repeat faster than frequency output their */
+/* average level rather than every edge, which is much faster and sounds the */
+/* same once resampled. something above 20000 is sensible, 0 disables (default). */
+void apu_set_ultrasonic_threshold(GbApu*, double frequency, double clock_rate);
+/* when enabled, output changes are logged per channel and added to the */
+/* resampler in one pass in apu_end_frame(), rather than as they happen. */
+/* the output is the same either way. returns 0 on faliure. */
+unsigned apu_set_event_log(GbApu*, unsigned enable);
+/* synthesises and resamples each psg channel as its own task in apu_end_frame(), */
+/* then mixes them on the calling thread. only worth it for large frames, such */
+/* as offline rendering. also enables the event log, NULL disables. */
+/* returns 0 on faliure. */
+unsigned apu_set_parallel_for(GbApu*, void* user, apu_parallel_for parallel_for, double clock_rate, double sample_rate);
+/* also outputs each channel in channel_mask to its own buffer, read with */
+/* apu_read_channel_samples(). bit n is channel_num n, so 0x3F is every channel */
+/* and 0 disables. the fifo channels are only output when agb, so call this */
+/* after apu_reset(). every enabled stem must be read (or cleared) along with */
+/* the mix. returns 0 on faliure. */
+unsigned apu_set_stem_output(GbApu*, unsigned channel_mask, double clock_rate, double sample_rate);
 /* only available with Blip_Buffer. */
 void apu_set_bass(GbApu*, int frequency);
 /* only available with Blip_Buffer. */
@@ -108,6 +162,10 @@ void apu_set_highpass_filter(GbApu*, enum GbApuFilter filter, double clock_rate,
 void apu_set_highpass_filter_custom(GbApu*, double charge_factor, double clock_rate, double sample_rate);
 /* enable zombie mode, forcefully disabled in agb mode. */
 void apu_set_zombie_mode(GbApu*, unsigned enable);
+/* when disabled, the state advances as normal but no samples are generated. */
+/* useful for run-ahead and rollback, enabled by default. */
+/* takes effect at time, this ends the frame there, see apu_end_frame(). */
+void apu_set_audio_output_enabled(GbApu*, unsigned enable, unsigned time);
 /* updates timestamp, useful if the time overflows. */
 void apu_update_timestamp(GbApu*, int time);
 
@@ -122,18 +180,85 @@ int apu_samples_avaliable(const GbApu*);
 void apu_end_frame(GbApu*, unsigned time);
 /* read stereo samples, returns the amount read. */
 int apu_read_samples(GbApu*, short out[], int count);
+/* same as above, but samples aren't clamped to 16-bits. floats are scaled so */
+/* that 1.0 is 16-bit full scale. any format can be read at any time. */
+int apu_read_samples_s32(GbApu*, int out[], int count);
+int apu_read_samples_f32(GbApu*, float out[], int count);
+/* same as above, but left and right are written to separate arrays, */
+/* count / 2 samples to each. returns the amount read from both. */
+int apu_read_samples_planar_s32(GbApu*, int out_l[], int out_r[], int count);
+int apu_read_samples_planar_f32(GbApu*, float out_l[], float out_r[], int count);
+/* read stereo samples of a single channel, requires apu_set_stem_output(). */
+/* the high-pass filter isn't applied. returns the amount read. */
+int apu_read_channel_samples(GbApu*, unsigned channel_num, short out[], int count);
+/* reads all available samples into an internal buffer, and sets samples to */
+/* point to every sample that hasn't been consumed yet, the same as */
+/* apu_read_samples() would output. samples stay valid until the next call to */
+/* this or a read function. returns 0 on faliure. */
+unsigned apu_peek_samples(GbApu*, const short** samples, int* count);
+/* removes count peeked samples, apu_read_samples() also removes them. */
+/* consume all peeked samples before using the other read functions. */
+void apu_consume_samples(GbApu*, int count);
 /* removes all samples. */
 void apu_clear_samples(GbApu*);
 
+/* ------------------------- */
+/* ------Output Ring Api---- */
+/* ------------------------- */
+/* for when samples are played on another thread, such as an audio callback. */
+/* not available if built with GB_APU_OUTPUT_RING=0, which is needed on */
+/* compilers without atomics. */
+/* once enabled, apu_end_frame() moves every sample into the ring, which is */
+/* then read with apu_output_ring_read() without taking a lock. */
+/* capacity is in samples and is rounded up to a power of 2, 0 frees the ring. */
+/* call before starting the audio thread, returns 0 on faliure. */
+unsigned apu_output_ring_init(GbApu*, unsigned capacity);
+/* call from the audio thread only, never blocks. count is rounded down to whole */
+/* frames, a multiple of 2 unless mono. if fewer than count samples are */
+/* available, the rest of out is left untouched. returns the amount read. */
+int apu_output_ring_read(GbApu*, short out[], int count);
+/* total samples that couldn't be read because the ring was empty. */
+unsigned apu_output_ring_underruns(const GbApu*);
+/* total samples that were dropped because the ring was full. */
+unsigned apu_output_ring_overruns(const GbApu*);
+
 /* ------------------------- */
 /* ------SaveState Api------ */
 /* ------------------------- */
+/* savestates are versioned and little-endian, so they can be shared between */
+/* platforms and loaded by newer versions of the library. */
 /* returns the size needed for savestates. */
 unsigned apu_state_size(void);
 /* creates a savestate, returns 0 on faliure and apu_state_size() on success. */
 unsigned apu_save_state(const GbApu*, void* data, unsigned size);
-/* loads a savestate, returns 0 on faliure and apu_state_size() on success. */
+/* loads a savestate, returns 0 on faliure and the size of the state on success. */
+/* older states that don't save the internal frame sequencer keep the current */
+/* apu_set_frame_sequencer_internal() setting, with the next step a period away. */
 unsigned apu_load_state(GbApu*, const void* data, unsigned size);
+/* same as above, but also saves the resampler and high-pass filter so that */
+/* audio continues seamlessly after loading, useful for rollback. */
+/* only save after apu_end_frame(), ideally after reading all samples. */
+/* loading removes all samples that haven't been read yet. */
+unsigned apu_state_size_ex(void);
+unsigned apu_save_state_ex(const GbApu*, void* data, unsigned size);
+unsigned apu_load_state_ex(GbApu*, const void* data, unsigned size);
+/* loads a savestate from before they were versioned, these are only compatible */
+/* with the same platform and compiler, returns 0 on faliure and size read on success. */
+unsigned apu_load_state_legacy(GbApu*, const void* data, unsigned size);
+
+/* ------------------------- */
+/* ------Snapshot Api------- */
+/* ------------------------- */
+/* allocates a ring of savestates for rollback, stored as deltas to save memory. */
+/* slot_count of 0 frees the ring, returns 0 on faliure. */
+unsigned apu_snapshot_init(GbApu*, unsigned slot_count);
+/* saves a snapshot, replacing the oldest if full, returns 0 on faliure. */
+unsigned apu_snapshot_push(GbApu*);
+/* restores the snapshot pushed age pushes ago (0 is the latest), */
+/* snapshots newer than it are removed. returns 0 if age >= apu_snapshot_count(). */
+unsigned apu_snapshot_restore(GbApu*, unsigned age);
+/* returns how many snapshots can be restored. */
+unsigned apu_snapshot_count(const GbApu*);
 
 #ifdef __cplusplus
 }